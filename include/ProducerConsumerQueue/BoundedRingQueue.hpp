@@ -0,0 +1,222 @@
+/*
+
+Bounded multi-producer multi-consumer queue with the same interface as
+ProducerConsumerQueue, based on a ring buffer in which each cell carries a
+sequence number, following the bounded MPMC queue by Dmitry Vyukov:
+http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+Pushing and popping only take a compare-and-swap on the enqueue or dequeue
+position. Threads spin for a short while when the queue is full or empty and
+then park on a condition variable, which is only signalled when there are
+parked threads.
+
+push_many() and pop_many() claim a run of consecutive cells with a single
+compare-and-swap.
+
+Copyright (c) 2019 Peter Menzel
+
+*/
+
+
+#ifndef __BoundedRingQueue__
+#define __BoundedRingQueue__
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdint.h>
+#include <stddef.h>
+
+template<typename Data>
+class BoundedRingQueue {
+
+	private:
+		struct Cell {
+			std::atomic<size_t> sequence;
+			Data data;
+		};
+
+		static const int spin_count = 64;
+		static const size_t cacheline_size = 64;
+
+		std::unique_ptr<Cell[]> buffer;
+		size_t buffer_mask;
+		char pad0[cacheline_size];
+		std::atomic<size_t> enqueue_pos;
+		char pad1[cacheline_size];
+		std::atomic<size_t> dequeue_pos;
+		char pad2[cacheline_size];
+		std::atomic<bool> pushed_last;
+		std::atomic<int> waiting_producers;
+		std::atomic<int> waiting_consumers;
+		std::mutex park_mutex;
+		std::condition_variable producer_cv;
+		std::condition_variable consumer_cv;
+
+		// wait until ready() is true or until woken up by notify()
+		template<typename Pred>
+		void park(std::atomic<int> & waiting, std::condition_variable & cv, Pred ready) {
+			std::unique_lock<std::mutex> park_lock(park_mutex);
+			waiting.fetch_add(1);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			// the timeout is only a safeguard against missed notifications
+			if(!ready()) cv.wait_for(park_lock, std::chrono::milliseconds(1));
+			waiting.fetch_sub(1);
+		}
+
+		void notify(std::atomic<int> & waiting, std::condition_variable & cv) {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if(waiting.load(std::memory_order_relaxed) > 0) {
+				std::lock_guard<std::mutex> park_lock(park_mutex);
+				cv.notify_all();
+			}
+		}
+
+	public:
+		BoundedRingQueue(const BoundedRingQueue&) = delete;
+		BoundedRingQueue& operator=(const BoundedRingQueue&) = delete;
+		BoundedRingQueue(size_t max_buffer_size) : enqueue_pos(0), dequeue_pos(0), pushed_last(false), waiting_producers(0), waiting_consumers(0) {
+			// the capacity is rounded up to the next power of 2
+			size_t capacity = 2;
+			while(capacity < max_buffer_size) capacity <<= 1;
+			buffer_mask = capacity - 1;
+			buffer.reset(new Cell[capacity]);
+			for(size_t i = 0; i < capacity; i++) {
+				buffer[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		// returns the number of elements from the beginning of new_elements that were pushed
+		size_t try_push_many(const Data * new_elements, size_t n) {
+			size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			while(n > 0) {
+				size_t k = 0;
+				while(k < n && k <= buffer_mask && buffer[(pos + k) & buffer_mask].sequence.load(std::memory_order_acquire) == pos + k) {
+					k++;
+				}
+				if(k == 0) {
+					const size_t seq = buffer[pos & buffer_mask].sequence.load(std::memory_order_acquire);
+					if(static_cast<intptr_t>(seq - pos) < 0) {
+						return 0; // queue is full
+					}
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+				}
+				else if(enqueue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+					for(size_t i = 0; i < k; i++) {
+						Cell & cell = buffer[(pos + i) & buffer_mask];
+						cell.data = new_elements[i];
+						cell.sequence.store(pos + i + 1, std::memory_order_release);
+					}
+					return k;
+				}
+			}
+			return 0;
+		}
+
+		// returns the number of elements that were popped into returned_elements
+		size_t try_pop_many(Data * returned_elements, size_t n) {
+			size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			while(n > 0) {
+				size_t k = 0;
+				while(k < n && k <= buffer_mask && buffer[(pos + k) & buffer_mask].sequence.load(std::memory_order_acquire) == pos + k + 1) {
+					k++;
+				}
+				if(k == 0) {
+					const size_t seq = buffer[pos & buffer_mask].sequence.load(std::memory_order_acquire);
+					if(static_cast<intptr_t>(seq - (pos + 1)) < 0) {
+						return 0; // queue is empty
+					}
+					pos = dequeue_pos.load(std::memory_order_relaxed);
+				}
+				else if(dequeue_pos.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+					for(size_t i = 0; i < k; i++) {
+						Cell & cell = buffer[(pos + i) & buffer_mask];
+						returned_elements[i] = cell.data;
+						cell.sequence.store(pos + i + buffer_mask + 1, std::memory_order_release);
+					}
+					return k;
+				}
+			}
+			return 0;
+		}
+
+		bool try_push(const Data & new_element) {
+			return try_push_many(&new_element, 1) == 1;
+		}
+
+		bool try_pop(Data & returned_element) {
+			return try_pop_many(&returned_element, 1) == 1;
+		}
+
+		// blocks until all n elements are pushed
+		void push_many(const Data * new_elements, size_t n) {
+			int spin = 0;
+			while(n > 0) {
+				const size_t k = try_push_many(new_elements, n);
+				if(k > 0) {
+					new_elements += k;
+					n -= k;
+					spin = 0;
+					continue;
+				}
+				notify(waiting_consumers, consumer_cv);
+				if(spin++ < spin_count) {
+					std::this_thread::yield();
+				}
+				else {
+					park(waiting_producers, producer_cv, [this]{ return size() <= buffer_mask; });
+				}
+			}
+			notify(waiting_consumers, consumer_cv);
+		}
+
+		// blocks until at least one element is available and returns the number
+		// of popped elements, or 0 if the queue is empty after pushedLast() was called
+		size_t pop_many(Data * returned_elements, size_t n) {
+			int spin = 0;
+			size_t k = 0;
+			while((k = try_pop_many(returned_elements, n)) == 0) {
+				if(pushed_last.load(std::memory_order_acquire)) {
+					// all pushes happened before pushedLast(), so this is the final check
+					k = try_pop_many(returned_elements, n);
+					if(k == 0) return 0;
+					break;
+				}
+				if(spin++ < spin_count) {
+					std::this_thread::yield();
+				}
+				else {
+					park(waiting_consumers, consumer_cv, [this]{ return size() > 0 || pushed_last.load(); });
+				}
+			}
+			notify(waiting_producers, producer_cv);
+			return k;
+		}
+
+		void push(const Data & new_element) {
+			push_many(&new_element, 1);
+		}
+
+		bool pop(Data & returned_element) {
+			return pop_many(&returned_element, 1) == 1;
+		}
+
+		void pushedLast() {
+			pushed_last.store(true, std::memory_order_release);
+			std::lock_guard<std::mutex> park_lock(park_mutex);
+			consumer_cv.notify_all();
+		}
+
+		// number of elements in the queue, which is only approximate while other threads push or pop
+		size_t size() const {
+			const size_t deq = dequeue_pos.load(std::memory_order_relaxed);
+			const size_t enq = enqueue_pos.load(std::memory_order_relaxed);
+			return enq > deq ? enq - deq : 0;
+		}
+
+};
+
+#endif
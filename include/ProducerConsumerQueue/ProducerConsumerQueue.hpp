@@ -83,12 +83,12 @@ class ProducerConsumerQueue {
 		bool pop(Data & returned_element) {
 			std::unique_lock<std::mutex> queue_lock(queue_mutex);
 
-				if(pushed_last && queue.empty()) {
+				consumer_cv.wait(queue_lock,[this]{return !queue.empty() || pushed_last;});
+
+				if(queue.empty()) {
 					return false;
 				}
 
-				consumer_cv.wait(queue_lock,[this]{return !queue.empty();});
-
 				returned_element = queue.front();
 				queue.pop_front();
 
@@ -0,0 +1,217 @@
+#include "CountEngine.hpp"
+
+template<typename KmerT>
+CountEngine<KmerT>::CountEngine(size_t num_threads, size_t num_slots, boophf<KmerT> * bphf, const KmerT * index2kmer, bool use_local_counts_, unsigned k, bool canonical) :
+	n_elem((KmerIndex)bphf->nbKeys()),
+	use_local_counts(use_local_counts_),
+	// each producer can hold two batches while filling them
+	batch_pool(2 * num_threads + 2 * num_slots),
+	// leaves room for the end marker of each thread
+	queue(batch_pool.size() + num_threads) {
+	for(size_t i = 0; i < num_slots; i++) {
+		samples.emplace_back(new SampleCounts(i, n_elem));
+	}
+	for(size_t i = 0; i < num_threads; i++) {
+		count_threads.emplace_back(new CountThread<KmerT>(&queue, &batch_pool, bphf, index2kmer, use_local_counts, num_slots, k, canonical));
+	}
+	for(size_t i = 0; i < num_threads; i++) {
+		threads.push_back(std::thread(&CountEngine::run, this, i));
+	}
+}
+
+template<typename KmerT>
+CountEngine<KmerT>::~CountEngine() {
+	stopQueue();
+	{
+		std::lock_guard<std::mutex> control_lock(control_mutex);
+		sendCommand(Command::stop);
+	}
+	for(auto & t : threads) {
+		t.join();
+	}
+}
+
+/**
+* Main loop of each thread, which waits for a command and executes it.
+*/
+template<typename KmerT>
+void CountEngine<KmerT>::run(size_t thread_index) noexcept {
+	CountThread<KmerT> & p = *count_threads[thread_index];
+	uint64_t seen_generation = 0;
+	while(true) {
+		std::unique_lock<std::mutex> control_lock(control_mutex);
+		command_cv.wait(control_lock, [&]{ return generation != seen_generation; });
+		seen_generation = generation;
+		const Command c = command;
+		control_lock.unlock();
+
+		if(c == Command::stop) break;
+		if(c == Command::count_queue) {
+			p.doWork();
+		}
+		else if(c == Command::count_file_range) {
+			const uint64_t from = range_file_size * thread_index / count_threads.size();
+			const uint64_t to = range_file_size * (thread_index + 1) / count_threads.size();
+			p.doWorkFileRange(*range_sample, range_filename, from, to, range_fastq);
+		}
+
+		control_lock.lock();
+		num_done++;
+		control_lock.unlock();
+		done_cv.notify_all();
+	}
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::sendCommand(Command c) {
+	command = c;
+	num_done = 0;
+	generation++;
+	command_cv.notify_all();
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::waitDone(std::unique_lock<std::mutex> & control_lock) {
+	done_cv.wait(control_lock, [this]{ return num_done == count_threads.size(); });
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::startQueue() {
+	std::lock_guard<std::mutex> control_lock(control_mutex);
+	if(queue_running) return;
+	queue_running = true;
+	sendCommand(Command::count_queue);
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::stopQueue() {
+	std::unique_lock<std::mutex> control_lock(control_mutex);
+	if(!queue_running) return;
+	queue_running = false;
+	// each thread stops at the first marker, so that every thread gets exactly one
+	for(size_t i = 0; i < count_threads.size(); i++) {
+		queue.push(nullptr);
+	}
+	waitDone(control_lock);
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::push(SampleCounts & sample, ReadBatch * batch) {
+	batch->sample = &sample;
+	sample.batchPushed();
+	queue.push(batch);
+}
+
+template<typename KmerT>
+bool CountEngine<KmerT>::countFileRanges(SampleCounts & sample, const std::string & filename, uint64_t file_size, bool fastq) {
+	stopQueue();
+	std::unique_lock<std::mutex> control_lock(control_mutex);
+	range_sample = &sample;
+	range_filename = filename;
+	range_file_size = file_size;
+	range_fastq = fastq;
+	sendCommand(Command::count_file_range);
+	waitDone(control_lock);
+	return CountThread<KmerT>::checkFileRanges(count_threads);
+}
+
+template<typename KmerT>
+std::string CountEngine<KmerT>::errorMessage() const {
+	for(auto & p : count_threads) {
+		if(!p->errorMessage().empty()) return p->errorMessage();
+	}
+	return std::string();
+}
+
+template<typename KmerT>
+ReadCount CountEngine<KmerT>::numReads() const {
+	ReadCount num_reads = 0;
+	for(auto & p : count_threads) num_reads += p->numReads();
+	return num_reads;
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::finishSample(SampleCounts & sample, size_t num_threads) {
+	sample.waitDone();
+	CountThread<KmerT>::reduceCounts(count_threads, sample, n_elem, num_threads);
+}
+
+template<typename KmerT>
+void CountEngine<KmerT>::clearCounts(SampleCounts & sample) {
+	finishSample(sample, count_threads.size());
+	sample.takeCounts(count_threads.size(), [](size_t, KmerIndex, KmerCount) {});
+}
+
+template<typename KmerT>
+double CountEngine<KmerT>::stallSeconds() const {
+	double seconds = 0;
+	for(auto & p : count_threads) seconds += p->stallSeconds();
+	return seconds;
+}
+
+template<typename KmerT>
+SampleScheduler<KmerT>::SampleScheduler(CountEngine<KmerT> & engine_) : engine(engine_) {
+	for(size_t i = engine.numSlots(); i > 0; i--) {
+		free_samples.push_back(&engine.sample(i - 1));
+	}
+}
+
+template<typename KmerT>
+SampleScheduler<KmerT>::~SampleScheduler() {
+	for(auto & job : jobs) {
+		if(job->thread.joinable()) job->thread.join();
+	}
+}
+
+template<typename KmerT>
+void SampleScheduler<KmerT>::count(Job * job, count_function_t count_function, size_t reduce_threads) noexcept {
+	try {
+		count_function(*job->sample);
+		engine.finishSample(*job->sample, reduce_threads);
+	}
+	catch(std::exception & e) {
+		job->error_message = e.what();
+	}
+}
+
+template<typename KmerT>
+void SampleScheduler<KmerT>::add(count_function_t count_function, commit_function_t commit_function) {
+	if(free_samples.empty()) commitFront();
+	std::unique_ptr<Job> job(new Job());
+	job->sample = free_samples.back();
+	free_samples.pop_back();
+	job->commit = commit_function;
+	if(engine.numSlots() == 1) {
+		// the only sample may use all threads for reducing the thread-local counts
+		count(job.get(), count_function, engine.numThreads());
+		jobs.push_back(std::move(job));
+		commitFront();
+	}
+	else {
+		job->thread = std::thread(&SampleScheduler::count, this, job.get(), count_function, 1);
+		jobs.push_back(std::move(job));
+	}
+}
+
+template<typename KmerT>
+void SampleScheduler<KmerT>::commitFront() {
+	std::unique_ptr<Job> job = std::move(jobs.front());
+	jobs.pop_front();
+	if(job->thread.joinable()) job->thread.join();
+	if(!job->error_message.empty()) throw std::runtime_error(job->error_message);
+	job->commit(*job->sample);
+	job->sample->num_reads = 0;
+	free_samples.push_back(job->sample);
+}
+
+template<typename KmerT>
+void SampleScheduler<KmerT>::finish() {
+	while(!jobs.empty()) {
+		commitFront();
+	}
+}
+
+template class CountEngine<Kmer>;
+template class CountEngine<Kmer128>;
+template class SampleScheduler<Kmer>;
+template class SampleScheduler<Kmer128>;
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "ReadBatch.hpp"
+#include "CountThread.hpp"
+#include "util.hpp"
+
+/**
+* Keeps the CountThreads with their threads, the queue of read batches and
+* the count arrays of num_slots samples for all samples of an input list, so
+* that these are not set up again for each sample.
+* A sample is counted either from the read batches pushed into the queue,
+* which can hold the batches of several samples at the same time, or by
+* splitting an uncompressed file into byte ranges with countFileRanges().
+* After finishSample(), the counts of the sample are in its SampleCounts. The
+* caller takes them with SampleCounts::takeCounts(), which only visits the
+* touched indices and sets them back to 0, so that the array does not need to
+* be cleared or scanned for every sample.
+* KmerT is the type of the k-mers of the index, see CountThread.
+*/
+template<typename KmerT>
+class CountEngine {
+	private:
+		// control messages for the threads, which wait for the next command when they are not counting
+		enum class Command { none, count_queue, count_file_range, stop };
+
+		KmerIndex n_elem;
+		bool use_local_counts;
+		std::deque<std::unique_ptr<SampleCounts>> samples;
+		ReadBatchPool batch_pool;
+		queue_t queue;
+		std::deque<std::unique_ptr<CountThread<KmerT>>> count_threads;
+		std::deque<std::thread> threads;
+
+		std::mutex control_mutex;
+		std::condition_variable command_cv;
+		std::condition_variable done_cv;
+		Command command = Command::none;
+		uint64_t generation = 0;
+		size_t num_done = 0;
+		bool queue_running = false;
+		SampleCounts * range_sample = nullptr;
+		std::string range_filename;
+		uint64_t range_file_size = 0;
+		bool range_fastq = false;
+
+		void run(size_t thread_index) noexcept;
+		// both must be called with control_mutex held
+		void sendCommand(Command);
+		void waitDone(std::unique_lock<std::mutex> &);
+		void stopQueue();
+
+	public:
+		CountEngine(CountEngine const&) = delete;
+		void operator=(CountEngine const&) = delete;
+		CountEngine(size_t num_threads, size_t num_slots, boophf<KmerT> * bphf, const KmerT * index2kmer, bool use_local_counts, unsigned k, bool canonical);
+		~CountEngine();
+
+		size_t numThreads() const { return count_threads.size(); }
+		size_t numSlots() const { return samples.size(); }
+		SampleCounts & sample(size_t slot) { return *samples[slot]; }
+
+		// the producers get empty batches from the pool and push them with push()
+		ReadBatchPool & batches() { return batch_pool; }
+		size_t queueSize() const { return queue.size(); }
+		// lets the threads count from the queue, if they are not doing so already
+		void startQueue();
+		void push(SampleCounts & sample, ReadBatch * batch);
+
+		// counts a file with one byte range per thread, while no other sample is
+		// counted, and returns false if the ranges did not line up at record boundaries
+		bool countFileRanges(SampleCounts & sample, const std::string & filename, uint64_t file_size, bool fastq);
+		// the first error of the threads in countFileRanges()
+		std::string errorMessage() const;
+		// number of reads parsed by the threads in countFileRanges()
+		ReadCount numReads() const;
+
+		// waits for the pushed batches of the sample and adds the thread-local counts and touched indices into it
+		void finishSample(SampleCounts & sample, size_t num_threads);
+		// discards the counts of the sample
+		void clearCounts(SampleCounts & sample);
+
+		// time spent waiting for read batches since the threads started counting, summed over all threads
+		double stallSeconds() const;
+};
+
+/**
+* Counts up to engine.numSlots() samples at the same time, each in its own
+* producer thread, and passes the finished samples to their commit function
+* in the order in which they were added. With only one slot, the samples are
+* counted in the calling thread.
+*/
+template<typename KmerT>
+class SampleScheduler {
+	public:
+		// fills the SampleCounts, errors are thrown as exceptions
+		using count_function_t = std::function<void(SampleCounts &)>;
+		using commit_function_t = std::function<void(SampleCounts &)>;
+
+	private:
+		struct Job {
+			SampleCounts * sample;
+			commit_function_t commit;
+			std::thread thread;
+			std::string error_message;
+		};
+
+		CountEngine<KmerT> & engine;
+		std::deque<std::unique_ptr<Job>> jobs;
+		std::vector<SampleCounts *> free_samples;
+
+		void count(Job * job, count_function_t count_function, size_t reduce_threads) noexcept;
+		void commitFront();
+
+	public:
+		SampleScheduler(SampleScheduler const&) = delete;
+		void operator=(SampleScheduler const&) = delete;
+		SampleScheduler(CountEngine<KmerT> & engine_);
+		~SampleScheduler();
+
+		// waits for a free slot, throws std::runtime_error if counting an earlier sample failed
+		void add(count_function_t count_function, commit_function_t commit_function);
+		// commits all remaining samples
+		void finish();
+};
@@ -1,60 +1,314 @@
 #include "CountThread.hpp"
 #include "util.hpp"
 
-CountThread::CountThread(queue_t * queue_, std::atomic<KmerCount> * counts_, boophf_t * bphf_, std::unordered_set<Kmer> * initial_kmers_) noexcept {
+// returns the instance of countEncoded() for k <= K
+template<typename KmerT>
+template<unsigned K>
+typename CountThread<KmerT>::count_function_t CountThread<KmerT>::selectCountFunction(unsigned k, bool canonical) noexcept {
+	if(k == K) return canonical ? &CountThread::countEncoded<K, true> : &CountThread::countEncoded<K, false>;
+	return selectCountFunction<K - 1>(k, canonical);
+}
+
+// the instances for 128 bit k-mers start above MAX_K_64
+template<> template<>
+CountThread<Kmer>::count_function_t CountThread<Kmer>::selectCountFunction<0>(unsigned, bool) noexcept {
+	return nullptr;
+}
+
+template<> template<>
+CountThread<Kmer128>::count_function_t CountThread<Kmer128>::selectCountFunction<MAX_K_64>(unsigned, bool) noexcept {
+	return nullptr;
+}
+
+SampleCounts::SampleCounts(size_t slot_, KmerIndex n_elem_) : slot(slot_), n_elem(n_elem_), counts(new std::atomic<KmerCount>[n_elem_]()) {
+}
+
+void SampleCounts::batchPushed() {
+	std::lock_guard<std::mutex> sample_lock(sample_mutex);
+	num_pushed++;
+}
+
+void SampleCounts::batchDone() {
+	std::lock_guard<std::mutex> sample_lock(sample_mutex);
+	num_done++;
+	if(num_done == num_pushed) sample_cv.notify_all();
+}
+
+void SampleCounts::waitDone() {
+	std::unique_lock<std::mutex> sample_lock(sample_mutex);
+	sample_cv.wait(sample_lock, [this]{ return num_done == num_pushed; });
+	num_pushed = num_done = 0;
+}
+
+template<typename KmerT>
+CountThread<KmerT>::CountThread(queue_t * queue_, ReadBatchPool * pool_, boophf<KmerT> * bphf_, const KmerT * index2kmer_, bool use_local_counts_, size_t num_slots, unsigned k_, bool canonical_) noexcept {
 	queue = queue_;
-	counts = counts_;
+	pool = pool_;
 	bphf = bphf_;
 	n_elem = (KmerIndex)bphf->nbKeys();
-	initial_kmers = initial_kmers_;
-	assert(initial_kmers->size() == n_elem);
-}
-
-void CountThread::doWork() noexcept {
-	ReadItem * item = nullptr;
-	while(queue->pop(item)) {
-		assert(item != nullptr);
-		assert(item->sequence1.length() >= KMER_K);
-		uint64_t t = 0;
-		const char * c = item->sequence1.c_str();
-		//init first K chars
-		for(int k=0; k<KMER_K; k++) {
-			uint8_t curr = DNA_MAP::A;
-			switch (*c) {
-				//case 'A': { curr = DNA_MAP::A; break; }
-				case 'T': { curr = DNA_MAP::T; break; }
-				case 'C': { curr = DNA_MAP::C; break; }
-				case 'G': { curr = DNA_MAP::G; break; }
-			}
-			t = t | curr;
-			if(k < KMER_K - 1) {
-				t = t << 2;
-				c++;
+	index2kmer = index2kmer_;
+	use_local_counts = use_local_counts_;
+	slots.resize(num_slots);
+	// beyond this, sorting the touched indices costs about as much as a scan of all counts
+	max_touched = n_elem / 16;
+	k = k_;
+	canonical = canonical_;
+	count_encoded = selectCountFunction<(sizeof(KmerT) > sizeof(Kmer)) ? MAX_K : MAX_K_64>(k, canonical);
+	assert(count_encoded != nullptr);
+}
+
+template<typename KmerT>
+void CountThread<KmerT>::selectSample(SampleCounts & sample) noexcept {
+	counts = sample.counts.get();
+	slot = &slots[sample.slot];
+	if(!use_local_counts) return;
+	// the thread-local buffer is allocated by the thread itself, so that its
+	// pages are placed close to the core that is using them, and is kept for
+	// the following samples, since reduceCounts() sets it back to 0
+	if(slot->local_counts.empty()) slot->local_counts.assign(n_elem, 0);
+	local = slot->local_counts.data();
+}
+
+/**
+* Counts the read batches from the queue into the samples that they belong
+* to, until the queue ends or a nullptr marks the end of the input.
+*/
+template<typename KmerT>
+void CountThread<KmerT>::doWork() noexcept {
+	ReadBatch * batch = nullptr;
+	while(true) {
+		stall_timer.start();
+		const bool ok = queue->pop(batch);
+		stall_timer.stop();
+		if(!ok || batch == nullptr) break;
+		SampleCounts * sample = batch->sample;
+		assert(sample != nullptr);
+		countBatch(*batch);
+		pool->put(batch);
+		sample->batchDone();
+	} // end while queue
+
+}
+
+/**
+* Parses and counts all records of an uncompressed FASTA/Q file that start
+* within the byte range [from, to).
+*/
+template<typename KmerT>
+void CountThread<KmerT>::doWorkFileRange(SampleCounts & sample, const std::string & filename, uint64_t from, uint64_t to, bool fastq) noexcept {
+	selectSample(sample);
+	error_message.clear();
+	num_reads = 0;
+	range_to = to;
+	range_first_record = range_next_record = std::numeric_limits<uint64_t>::max();
+	try {
+		// start reading one byte early, so that a record starting exactly at
+		// position from is found after the preceding line break
+		const uint64_t source_start = from > 0 ? from - 1 : 0;
+		FileSource source(filename, source_start);
+		FastxParser parser(source);
+		parser.setFormat(fastq);
+		parser.setLimit(to - source_start);
+		if(from > 0 && !parser.syncToRecord()) return;
+		range_first_record = from > 0 ? source_start + parser.offset() : 0;
+		const char * seq = nullptr;
+		size_t length = 0;
+		while(parser.next(seq, length)) {
+			num_reads++;
+			if(length >= k) {
+				countSequence(seq, length);
 			}
 		}
-		while(true) {
-			if(initial_kmers->find(t) != initial_kmers->end()) {
-				const KmerIndex index = bphf->lookup(t);
-				assert(index < n_elem);
-				counts[index]++;
-			}
-			c++;
-			if(*c == '\0') break;
-			uint8_t curr = DNA_MAP::A;
-			switch (*c) {
-				//case 'A': { curr = DNA_MAP::A; break; }
-				case 'T': { curr = DNA_MAP::T; break; }
-				case 'C': { curr = DNA_MAP::C; break; }
-				case 'G': { curr = DNA_MAP::G; break; }
+		range_next_record = source_start + parser.offset();
+	}
+	catch(std::runtime_error & e) {
+		error_message = e.what();
+	}
+}
+
+/**
+* Checks that the records found by the CountThreads after doWorkFileRange()
+* line up, i.e. each thread started at the record following the last record
+* of the preceding threads, so that every record was counted exactly once.
+*/
+template<typename KmerT>
+bool CountThread<KmerT>::checkFileRanges(const std::deque<std::unique_ptr<CountThread>> & threadpointers) noexcept {
+	const uint64_t none = std::numeric_limits<uint64_t>::max();
+	uint64_t next_record = threadpointers.front()->range_next_record;
+	for(size_t i = 1; i < threadpointers.size(); i++) {
+		const CountThread & p = *threadpointers[i];
+		if(next_record < p.range_to) {
+			if(p.range_first_record != next_record) return false;
+			next_record = p.range_next_record;
+		}
+		else if(p.range_first_record != none) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+* Encodes all sequences of the batch in one pass and counts their k-mers.
+*/
+template<typename KmerT>
+void CountThread<KmerT>::countBatch(const ReadBatch & batch) noexcept {
+	selectSample(*batch.sample);
+	if(codes.size() < batch.bytes()) codes.resize(batch.bytes());
+	encode_bases(batch.data(), batch.bytes(), codes.data());
+	for(size_t i = 0; i < batch.size(); i++) {
+		(this->*count_encoded)(codes.data() + (batch.sequence(i) - batch.data()), batch.length(i));
+	}
+}
+
+template<typename KmerT>
+void CountThread<KmerT>::countSequence(const char * c, size_t length) noexcept {
+	if(codes.size() < length) codes.resize(length);
+	encode_bases(c, length, codes.data());
+	(this->*count_encoded)(codes.data(), length);
+}
+
+/**
+* Counts the k-mers of the encoded sequence that do not contain any invalid
+* code. After each invalid code, the k-mer window starts anew, so that the
+* following K - 1 positions are not looked up at all.
+*/
+template<typename KmerT>
+template<unsigned K, bool canonical_kmers>
+void CountThread<KmerT>::countEncoded(const uint8_t * c, size_t length) noexcept {
+	// the k-mers are generated in blocks, which bounds the buffer size for long sequences
+	const size_t block_size = 1 << 12;
+	if(kmers.size() < block_size) kmers.resize(block_size);
+	const uint8_t * const end = c + length;
+	while(static_cast<size_t>(end - c) >= K) {
+		const uint8_t * invalid = static_cast<const uint8_t *>(memchr(c, CODE_INVALID, static_cast<size_t>(end - c)));
+		const uint8_t * const segment_end = invalid == nullptr ? end : invalid;
+		if(static_cast<size_t>(segment_end - c) >= K) {
+			KmerT t = 0, rc = 0;
+			if(canonical_kmers) rolling_canonical_kmers<K>(c, K - 1, t, rc, kmers.data());
+			else rolling_kmers<K>(c, K - 1, t, kmers.data());
+			for(const uint8_t * p = c + K - 1; p < segment_end; ) {
+				const size_t n = std::min(block_size, static_cast<size_t>(segment_end - p));
+				if(canonical_kmers) rolling_canonical_kmers<K>(p, n, t, rc, kmers.data());
+				else rolling_kmers<K>(p, n, t, kmers.data());
+				p += n;
+				countKmers(kmers.data(), n);
 			}
-			t = t << 2;
-			t = t | curr;
 		}
+		if(invalid == nullptr) break;
+		c = invalid + 1;
+	}
+}
 
-		delete item;
+template<typename KmerT>
+void CountThread<KmerT>::countKmers(const KmerT * k, size_t n) noexcept {
+	for(size_t i = 0; i < n; i++) {
+		// the MPHF maps k-mers outside of the indexed set to arbitrary indices,
+		// therefore the k-mer stored at that index must be compared
+		const KmerIndex index = bphf->lookup(k[i]);
+		if(index < n_elem && index2kmer[index] == k[i]) {
+			const KmerCount old = use_local_counts ? local[index]++ : counts[index].fetch_add(1, std::memory_order_relaxed);
+			if(old == 0 && !slot->dense) addTouched(index);
+		}
+	}
+}
 
-	} // end while queue
+template<typename KmerT>
+void CountThread<KmerT>::addTouched(KmerIndex index) noexcept {
+	if(slot->touched.size() < max_touched) {
+		slot->touched.push_back(index);
+	}
+	else {
+		slot->dense = true;
+		std::vector<KmerIndex>().swap(slot->touched);
+	}
+}
 
+template<typename KmerT>
+void CountThread<KmerT>::addLocalCounts(SampleCounts & sample, KmerIndex from, KmerIndex to) noexcept {
+	std::vector<KmerCount> & slot_counts = slots[sample.slot].local_counts;
+	// the buffer is empty if this thread did not count any reads of the slot yet
+	if(slot_counts.empty()) return;
+	std::atomic<KmerCount> * sample_counts = sample.counts.get();
+	for(KmerIndex i = from; i < to; i++) {
+		if(slot_counts[i] > 0) {
+			sample_counts[i].store(sample_counts[i].load(std::memory_order_relaxed) + slot_counts[i], std::memory_order_relaxed);
+			slot_counts[i] = 0;
+		}
+	}
 }
 
+/**
+* Adds the thread-local counts of all CountThreads for the slot of the sample
+* into the counts of the sample, sets them back to 0 and collects the touched
+* indices of the sample. As long as no thread exceeded its touched list, this
+* only visits the counted indices. Otherwise the index range is split into
+* blocks, which are distributed over num_threads threads, so that each entry
+* of counts is only written by one thread, and the sample is marked as dense.
+*/
+template<typename KmerT>
+void CountThread<KmerT>::reduceCounts(std::deque<std::unique_ptr<CountThread>> & threadpointers, SampleCounts & sample, KmerIndex n_elem, size_t num_threads) noexcept {
+	bool dense = false;
+	for(auto & p : threadpointers) {
+		dense |= p->slots[sample.slot].dense;
+	}
+
+	if(!dense) {
+		std::atomic<KmerCount> * sample_counts = sample.counts.get();
+		for(auto & p : threadpointers) {
+			SlotCounts & s = p->slots[sample.slot];
+			if(p->use_local_counts) {
+				for(KmerIndex i : s.touched) {
+					const KmerCount old = sample_counts[i].load(std::memory_order_relaxed);
+					if(old == 0) sample.touched.push_back(i);
+					sample_counts[i].store(old + s.local_counts[i], std::memory_order_relaxed);
+					s.local_counts[i] = 0;
+				}
+			}
+			else {
+				sample.touched.insert(sample.touched.end(), s.touched.begin(), s.touched.end());
+			}
+			s.touched.clear();
+		}
+		// the union of the touched lists of all threads can still be too large for sorting
+		if(sample.touched.size() > threadpointers.front()->max_touched) {
+			sample.dense = true;
+			std::vector<KmerIndex>().swap(sample.touched);
+		}
+		else {
+			std::sort(sample.touched.begin(), sample.touched.end());
+		}
+		return;
+	}
+
+	sample.dense = true;
+	std::vector<KmerIndex>().swap(sample.touched);
+	for(auto & p : threadpointers) {
+		SlotCounts & s = p->slots[sample.slot];
+		std::vector<KmerIndex>().swap(s.touched);
+		s.dense = false;
+	}
+	if(!threadpointers.front()->use_local_counts) return;
+	const KmerIndex block_size = 1 << 14;
+	std::atomic<KmerIndex> next_block(0);
+	auto reduce = [&]() {
+		KmerIndex from;
+		while((from = next_block.fetch_add(block_size)) < n_elem) {
+			const KmerIndex to = std::min(from + block_size, n_elem);
+			for(auto & p : threadpointers) {
+				p->addLocalCounts(sample, from, to);
+			}
+		}
+	};
+	std::deque<std::thread> threads;
+	for(size_t i = 1; i < num_threads; i++) {
+		threads.push_back(std::thread(reduce));
+	}
+	reduce();
+	for(auto & t : threads) {
+		t.join();
+	}
+}
 
+template class CountThread<Kmer>;
+template class CountThread<Kmer128>;
@@ -21,24 +21,145 @@
 #include <utility>
 #include <functional>
 #include <locale>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <condition_variable>
 
-#include "ProducerConsumerQueue/ProducerConsumerQueue.hpp"
-#include "ReadItem.hpp"
+#include "ProducerConsumerQueue/BoundedRingQueue.hpp"
+#include "ReadBatch.hpp"
+#include "FastxParser.hpp"
+#include "KmerEncoder.hpp"
 #include "util.hpp"
 
-using queue_t = ProducerConsumerQueue<ReadItem*>;
+using queue_t = BoundedRingQueue<ReadBatch*>;
 
+/**
+* Counts of one sample. Several samples can be counted at the same time, in
+* which case each has its own slot, which selects the thread-local count
+* buffers of the CountThreads. The producer announces each read batch with
+* batchPushed() and the CountThreads report it with batchDone().
+* The indices with a count > 0 are collected in touched, unless there are too
+* many of them, in which case dense is set and takeCounts() scans all counts.
+*/
+class SampleCounts {
+	private:
+		std::mutex sample_mutex;
+		std::condition_variable sample_cv;
+		size_t num_pushed = 0;
+		size_t num_done = 0;
+
+	public:
+		const size_t slot;
+		const KmerIndex n_elem;
+		std::unique_ptr<std::atomic<KmerCount>[]> counts;
+		std::vector<KmerIndex> touched;
+		bool dense = false;
+		ReadCount num_reads = 0;
+
+		SampleCounts(SampleCounts const&) = delete;
+		void operator=(SampleCounts const&) = delete;
+		SampleCounts(size_t slot_, KmerIndex n_elem);
+		void batchPushed();
+		void batchDone();
+		// waits until all pushed batches are counted
+		void waitDone();
+
+		// calls f(part, index, count) for each count > 0 and sets the counts back
+		// to 0 for the next sample. The touched indices, or all indices if the
+		// sample is dense, are split into num_threads consecutive parts, which
+		// are taken by separate threads, each in the order of the indices.
+		template<typename F>
+		void takeCounts(size_t num_threads, F f) {
+			const size_t n = dense ? n_elem : touched.size();
+			// starting a thread is not worth it for a few indices
+			const size_t min_part_size = 1 << 14;
+			num_threads = std::max<size_t>(1, std::min(num_threads, n / min_part_size));
+			auto take = [&](size_t part) {
+				const size_t from = n * part / num_threads;
+				const size_t to = n * (part + 1) / num_threads;
+				for(size_t j = from; j < to; j++) {
+					const KmerIndex i = dense ? j : touched[j];
+					const KmerCount c = counts[i].exchange(0, std::memory_order_relaxed);
+					if(c > 0) f(part, i, c);
+				}
+			};
+			std::deque<std::thread> threads;
+			for(size_t part = 1; part < num_threads; part++) {
+				threads.push_back(std::thread(take, part));
+			}
+			take(0);
+			for(auto & t : threads) {
+				t.join();
+			}
+			touched.clear();
+			dense = false;
+		}
+};
+
+/**
+* Counts the k-mers of the reads, which are of type Kmer for k <= MAX_K_64 and
+* Kmer128 otherwise.
+*/
+template<typename KmerT>
 class CountThread {
 	protected:
 	queue_t * queue;
-	std::atomic<KmerCount> * counts;
-	boophf_t * bphf;
+	ReadBatchPool * pool;
+	boophf<KmerT> * bphf;
 	KmerIndex n_elem;
-	std::unordered_set<Kmer> * initial_kmers;
+	const KmerT * index2kmer;
+	bool use_local_counts;
+	unsigned k;
+	bool canonical;
+	// per slot the thread-local counts and the indices that this thread
+	// counted first in the sample, which are recorded until there are more
+	// than max_touched of them
+	struct SlotCounts {
+		std::vector<KmerCount> local_counts;
+		std::vector<KmerIndex> touched;
+		bool dense = false;
+	};
+	std::vector<SlotCounts> slots;
+	KmerIndex max_touched;
+	// the slot and counts of the current sample
+	SlotCounts * slot = nullptr;
+	std::atomic<KmerCount> * counts = nullptr;
+	KmerCount * local = nullptr;
+	// 2-bit codes of the current sequences and buffer for their k-mers
+	std::vector<uint8_t> codes;
+	std::vector<KmerT> kmers;
+	ReadCount num_reads = 0;
+	std::string error_message;
+	StallTimer stall_timer;
+	// byte range of the file assigned to this thread and the offsets of the
+	// first parsed record and of the record following the last parsed one
+	uint64_t range_to = 0;
+	uint64_t range_first_record = 0;
+	uint64_t range_next_record = 0;
+
+	void selectSample(SampleCounts &) noexcept;
+	void countBatch(const ReadBatch &) noexcept;
+	void countSequence(const char *, size_t) noexcept;
+	// countEncoded() specialised for k and canonical k-mers
+	using count_function_t = void (CountThread::*)(const uint8_t *, size_t);
+	count_function_t count_encoded;
+	template<unsigned K, bool canonical_kmers> void countEncoded(const uint8_t *, size_t) noexcept;
+	template<unsigned K> static count_function_t selectCountFunction(unsigned k, bool canonical) noexcept;
+	void countKmers(const KmerT *, size_t) noexcept;
+	void addTouched(KmerIndex) noexcept;
+	void addLocalCounts(SampleCounts &, KmerIndex from, KmerIndex to) noexcept;
 
 	public:
-	CountThread(queue_t *, std::atomic<KmerCount> *,boophf_t *, std::unordered_set<Kmer> *) noexcept;
+	CountThread(queue_t *, ReadBatchPool *, boophf<KmerT> *, const KmerT *, bool, size_t, unsigned, bool) noexcept;
 	void doWork() noexcept;
+	void doWorkFileRange(SampleCounts &, const std::string &, uint64_t, uint64_t, bool) noexcept;
+	ReadCount numReads() const { return num_reads; }
+	const std::string & errorMessage() const { return error_message; }
+	// time spent waiting for read batches
+	double stallSeconds() const { return stall_timer.seconds(); }
+	static bool checkFileRanges(const std::deque<std::unique_ptr<CountThread>> &) noexcept;
+	static void reduceCounts(std::deque<std::unique_ptr<CountThread>> &, SampleCounts &, KmerIndex, size_t) noexcept;
 	CountThread(CountThread const&) = delete;
 	void operator=(CountThread const&) = delete;
 
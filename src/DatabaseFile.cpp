@@ -0,0 +1,287 @@
+#include "DatabaseFile.hpp"
+#include "Deflater.hpp"
+#include "Inflater.hpp"
+#include "PostingCodec.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+// reads length bytes at offset, the file must not end before
+static void read_at(int fd, void * dst, size_t length, size_t offset) {
+	char * p = static_cast<char *>(dst);
+	while(length > 0) {
+		const ssize_t n = pread(fd, p, length, static_cast<off_t>(offset));
+		if(n <= 0) throw std::runtime_error(n == 0 ? "file truncated" : "could not read file");
+		p += n;
+		offset += static_cast<size_t>(n);
+		length -= static_cast<size_t>(n);
+	}
+}
+
+// the size of the header in the file, which has no flags and k before version 4
+static size_t header_size(const HeaderDbFile & header) {
+	size_t size = sizeof(header.magic) + sizeof(header.dbVer);
+	if(header.dbVer >= DB_VERSION_FLAGS) size += sizeof(header.flags) + sizeof(header.k);
+	if(header.flags & DB_FLAG_MERGED_LOG) size += sizeof(header.mergedLogSize) + sizeof(header.mergedLogCrc) + sizeof(header.padding);
+	return size;
+}
+
+// compresses database files about as well as the default level 6 of zlib, in a third of the time
+static const int block_compression_level = 4;
+
+static size_t num_threads_for(size_t num_jobs) {
+	return std::max(static_cast<size_t>(1), std::min(static_cast<size_t>(std::thread::hardware_concurrency()), num_jobs));
+}
+
+template<typename KmerT>
+DatabaseFile<KmerT>::DatabaseFile(const std::string & filename, const HeaderDbFile & header_, boophf<KmerT> * bphf, bool random_access) : header(header_) {
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if(fd == -1) { error("Could not open file " + filename); exit(EXIT_FAILURE); }
+	struct stat st;
+	if(fstat(fd, &st) != 0) { close(fd); error("Could not open file " + filename); exit(EXIT_FAILURE); }
+	const size_t file_size = static_cast<size_t>(st.st_size);
+	const size_t start = header_size(header);
+
+	const char * body = nullptr;
+	size_t body_size = 0;
+	try {
+		if(file_size < start) throw std::runtime_error("file truncated");
+		if(header.flags & DB_FLAG_BLOCKS) {
+			std::cerr << getCurrentTime() << " Decompressing database file " << filename << "\n";
+			body_size = readBlocks(fd, file_size, start);
+			body = buffer.get();
+		}
+		else {
+			mapFile(fd, file_size, random_access);
+			body = static_cast<const char *>(map) + start;
+			body_size = file_size - start;
+		}
+	}
+	catch(...) {
+		close(fd);
+		throw;
+	}
+	close(fd);
+
+	try {
+		parse(body, body_size, bphf);
+	}
+	catch(...) {
+		if(map != nullptr) munmap(map, map_size);
+		throw;
+	}
+}
+
+template<typename KmerT>
+DatabaseFile<KmerT>::~DatabaseFile() {
+	if(map != nullptr) munmap(map, map_size);
+}
+
+template<typename KmerT>
+void DatabaseFile<KmerT>::mapFile(int fd, size_t file_size, bool random_access) {
+	void * p = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) throw std::runtime_error("could not map file");
+	map = p;
+	map_size = file_size;
+	// the kernel reads ahead less for random accesses, otherwise the whole file is prefetched
+	madvise(map, map_size, random_access ? MADV_RANDOM : MADV_WILLNEED);
+}
+
+/**
+* Decompresses the blocks after the header at start into the buffer and
+* returns their total size. The threads take the next block from a shared
+* counter, since each block is written to its own position in the buffer.
+*/
+template<typename KmerT>
+size_t DatabaseFile<KmerT>::readBlocks(int fd, size_t file_size, size_t start) {
+	TrailerDbBlocks trailer;
+	TrailerDbBlocks trailer_ref;
+	const size_t trailer_size = sizeof(trailer.numBlocks) + sizeof(trailer.size) + sizeof(trailer.label);
+	if(file_size - start < trailer_size) throw std::runtime_error("file truncated");
+	read_at(fd, &trailer.numBlocks, sizeof(trailer.numBlocks), file_size - trailer_size);
+	read_at(fd, &trailer.size, sizeof(trailer.size), file_size - trailer_size + sizeof(trailer.numBlocks));
+	read_at(fd, &trailer.label, sizeof(trailer.label), file_size - sizeof(trailer.label));
+	if(memcmp(trailer.label, trailer_ref.label, sizeof(trailer.label)) != 0) throw std::runtime_error("invalid block index, file corruption detected");
+
+	DbBlock b;
+	const size_t entry_size = sizeof(b.compressedSize) + sizeof(b.size) + sizeof(b.crc);
+	if(trailer.numBlocks > (file_size - start - trailer_size) / entry_size) throw std::runtime_error("invalid block index, file corruption detected");
+	const size_t num_blocks = static_cast<size_t>(trailer.numBlocks);
+	const size_t index_start = file_size - trailer_size - num_blocks * entry_size;
+	std::vector<uint32_t> entries(3 * num_blocks);
+	read_at(fd, entries.data(), entries.size() * sizeof(uint32_t), index_start);
+	std::vector<DbBlock> blocks(num_blocks);
+	// the positions of the blocks in the file and in the buffer
+	std::vector<uint64_t> file_pos(num_blocks), buffer_pos(num_blocks);
+	uint64_t pos = start, size = 0;
+	for(size_t i = 0; i < num_blocks; i++) {
+		blocks[i].compressedSize = entries[3 * i];
+		blocks[i].size = entries[3 * i + 1];
+		blocks[i].crc = entries[3 * i + 2];
+		if(blocks[i].size > DB_BLOCK_SIZE || blocks[i].compressedSize > index_start - pos) throw std::runtime_error("invalid block index, file corruption detected");
+		file_pos[i] = pos;
+		buffer_pos[i] = size;
+		pos += blocks[i].compressedSize;
+		size += blocks[i].size;
+	}
+	if(pos != index_start || size != trailer.size) throw std::runtime_error("invalid block index, file corruption detected");
+
+	buffer.reset(new char[size]);
+	const size_t num_threads = num_threads_for(num_blocks);
+	std::atomic<size_t> next_block(0);
+	std::vector<std::string> errors(num_threads);
+	auto decompress = [&](size_t t) {
+		try {
+			Inflater inflater;
+			std::vector<char> in;
+			for(size_t i = next_block++; i < num_blocks; i = next_block++) {
+				in.resize(blocks[i].compressedSize);
+				read_at(fd, in.data(), in.size(), file_pos[i]);
+				char * out = buffer.get() + buffer_pos[i];
+				if(inflater.inflateRaw(in.data(), in.size(), out, blocks[i].size) != blocks[i].size || Inflater::crc32(out, blocks[i].size) != blocks[i].crc) {
+					throw std::runtime_error("invalid block " + std::to_string(i) + ", file corruption detected");
+				}
+			}
+		}
+		catch(std::exception & e) {
+			errors[t] = e.what();
+			// the other threads stop after their current block
+			next_block = num_blocks;
+		}
+	};
+	std::vector<std::thread> threads;
+	for(size_t t = 1; t < num_threads; t++) threads.push_back(std::thread(decompress, t));
+	decompress(0);
+	for(auto & t : threads) t.join();
+	for(const std::string & e : errors) {
+		if(!e.empty()) throw std::runtime_error(e);
+	}
+	return size;
+}
+
+template<typename KmerT>
+void DatabaseFile<KmerT>::parse(const char * body, size_t body_size, boophf<KmerT> * bphf) {
+	size_t pos = 0;
+	auto section = [&](uint64_t n, size_t size) {
+		if(n > (body_size - pos) / size) throw std::runtime_error("file truncated");
+		const char * s = body + pos;
+		pos += n * size;
+		return s;
+	};
+	uint64_t n = 0;
+	memcpy(&n, section(1, sizeof(n)), sizeof(n));
+	if(n != bphf->nbKeys()) throw std::runtime_error("Mismatching number of k-mers in hash index and k-mer database");
+	if((header.k > MAX_K_64) != (sizeof(KmerT) > sizeof(Kmer))) throw std::runtime_error("Mismatching k-mer length in hash index and k-mer database");
+
+	// 128 bit k-mers are aligned to 16 bytes by padding
+	if(sizeof(KmerT) > sizeof(Kmer)) section(1, sizeof(uint64_t));
+	kmers = reinterpret_cast<const KmerT *>(section(n, sizeof(KmerT)));
+	offsets = reinterpret_cast<const uint64_t *>(section(n + 1, sizeof(uint64_t)));
+	if(offsets[0] != 0) throw std::runtime_error("invalid offset of k-mer index 0, file corruption detected");
+	num_postings = offsets[n];
+	if(header.flags & DB_FLAG_COMPRESSED) {
+		// num_postings is the size of the compressed lists in bytes, which are
+		// followed by the metadata as padding for decode_postings()
+		encoded = reinterpret_cast<const uint8_t *>(section(num_postings, 1));
+		if(body_size - pos < POSTINGS_PADDING) throw std::runtime_error("file truncated");
+	}
+	else {
+		exp_ids = reinterpret_cast<const ExperimentId *>(section(num_postings, sizeof(ExperimentId)));
+		counts = reinterpret_cast<const KmerCount *>(section(num_postings, sizeof(KmerCount)));
+	}
+	num_kmers = n;
+	metadata = body + pos;
+	metadata_size = body_size - pos;
+}
+
+template<typename KmerT>
+void DatabaseFile<KmerT>::readMetadata(ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, ExpName2Id & exp_name2id, ExpId2ReadCount & exp_id2readcount) const {
+	std::istringstream is(std::string(metadata, metadata_size));
+	read_metadata(is, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+}
+
+template class DatabaseFile<Kmer>;
+template class DatabaseFile<Kmer128>;
+
+
+BlockWriter::BlockWriter(std::ostream & os_, size_t num_threads) : os(os_) {
+	num_threads = std::max(num_threads, static_cast<size_t>(1));
+	blocks.resize(num_threads);
+	compressed.resize(num_threads);
+	deflaters.resize(num_threads);
+	for(auto & block : blocks) block.resize(DB_BLOCK_SIZE);
+	setp(blocks[0].data(), blocks[0].data() + DB_BLOCK_SIZE);
+}
+
+BlockWriter::~BlockWriter() { }
+
+int BlockWriter::overflow(int c) {
+	if(pptr() == epptr()) {
+		if(++current == blocks.size()) {
+			writeBlocks(blocks.size(), DB_BLOCK_SIZE);
+			current = 0;
+		}
+		setp(blocks[current].data(), blocks[current].data() + DB_BLOCK_SIZE);
+	}
+	if(c != traits_type::eof()) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+void BlockWriter::writeBlocks(size_t num_blocks, size_t last_size) {
+	std::vector<DbBlock> written(num_blocks);
+	std::vector<std::string> errors(num_blocks);
+	auto compress = [&](size_t b) {
+		try {
+			const size_t n = b + 1 == num_blocks ? last_size : DB_BLOCK_SIZE;
+			if(!deflaters[b]) deflaters[b].reset(new Deflater(block_compression_level));
+			compressed[b].resize(deflaters[b]->bound(n));
+			compressed[b].resize(deflaters[b]->deflateRaw(blocks[b].data(), n, compressed[b].data(), compressed[b].size()));
+			written[b].compressedSize = static_cast<uint32_t>(compressed[b].size());
+			written[b].size = static_cast<uint32_t>(n);
+			written[b].crc = Inflater::crc32(blocks[b].data(), n);
+		}
+		catch(std::exception & e) {
+			errors[b] = e.what();
+		}
+	};
+	std::vector<std::thread> threads;
+	for(size_t b = 1; b < num_blocks; b++) threads.push_back(std::thread(compress, b));
+	compress(0);
+	for(auto & t : threads) t.join();
+	for(const std::string & e : errors) {
+		if(!e.empty()) throw std::runtime_error(e);
+	}
+	for(size_t b = 0; b < num_blocks; b++) {
+		os.write(compressed[b].data(), static_cast<std::streamsize>(compressed[b].size()));
+		index.push_back(written[b]);
+		size += written[b].size;
+	}
+}
+
+void BlockWriter::finish() {
+	const size_t last_size = static_cast<size_t>(pptr() - pbase());
+	if(current > 0 || last_size > 0) writeBlocks(current + 1, last_size);
+	current = 0;
+	setp(blocks[0].data(), blocks[0].data() + DB_BLOCK_SIZE);
+
+	for(const DbBlock & b : index) {
+		os.write(reinterpret_cast<const char *>(&b.compressedSize), sizeof(b.compressedSize));
+		os.write(reinterpret_cast<const char *>(&b.size), sizeof(b.size));
+		os.write(reinterpret_cast<const char *>(&b.crc), sizeof(b.crc));
+	}
+	TrailerDbBlocks trailer;
+	trailer.numBlocks = index.size();
+	trailer.size = size;
+	os.write(reinterpret_cast<const char *>(&trailer.numBlocks), sizeof(trailer.numBlocks));
+	os.write(reinterpret_cast<const char *>(&trailer.size), sizeof(trailer.size));
+	os.write(reinterpret_cast<const char *>(&trailer.label), sizeof(trailer.label));
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+class Deflater;
+
+/**
+* The sections of a database file with the offset table (version 3 and
+* later) in memory. The file is memory-mapped, or, if it is compressed in
+* blocks (DB_FLAG_BLOCKS), decompressed into memory by multiple threads.
+* KmerT is the type of the k-mers of the index, which must match k in the
+* header. Format errors are thrown as std::runtime_error.
+*/
+template<typename KmerT>
+class DatabaseFile {
+	private:
+		void * map = nullptr;
+		size_t map_size = 0;
+		// the decompressed content of a file with blocks
+		std::unique_ptr<char[]> buffer;
+
+		void mapFile(int fd, size_t file_size, bool random_access);
+		size_t readBlocks(int fd, size_t file_size, size_t start);
+		void parse(const char * body, size_t size, boophf<KmerT> * bphf);
+
+	public:
+		HeaderDbFile header;
+		uint64_t num_kmers = 0;
+		const KmerT * kmers = nullptr;
+		// num_kmers + 1 offsets indexed by MPHF index, see HeaderDbFile
+		const uint64_t * offsets = nullptr;
+		// the number of postings, or the size of the compressed lists in bytes
+		uint64_t num_postings = 0;
+		const ExperimentId * exp_ids = nullptr;
+		const KmerCount * counts = nullptr;
+		// the compressed lists, which are followed by at least POSTINGS_PADDING bytes
+		const uint8_t * encoded = nullptr;
+		const char * metadata = nullptr;
+		size_t metadata_size = 0;
+
+		DatabaseFile(DatabaseFile const&) = delete;
+		void operator=(DatabaseFile const&) = delete;
+		// header is read with read_database_header() by the caller, random_access
+		// announces that only few k-mers are looked up in a mapped file
+		DatabaseFile(const std::string & filename, const HeaderDbFile & header, boophf<KmerT> * bphf, bool random_access);
+		~DatabaseFile();
+
+		void readMetadata(ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, ExpName2Id & exp_name2id, ExpId2ReadCount & exp_id2readcount) const;
+};
+
+/**
+* Stream buffer for writing the content of a database file with
+* DB_FLAG_BLOCKS after the header. The data is collected in blocks of
+* DB_BLOCK_SIZE bytes, which are compressed by one thread each once there
+* is a full block for each thread, and written to the file in order.
+* finish() writes the remaining blocks, the block index and the trailer.
+* A compression error sets the badbit of the stream that writes to the
+* buffer.
+*/
+class BlockWriter : public std::streambuf {
+	private:
+		std::ostream & os;
+		std::vector<std::vector<char>> blocks;
+		std::vector<std::vector<char>> compressed;
+		std::vector<std::unique_ptr<Deflater>> deflaters;
+		std::vector<DbBlock> index;
+		// the block that is being filled
+		size_t current = 0;
+		uint64_t size = 0;
+
+		// compresses and writes the first num_blocks blocks, the last one with last_size bytes
+		void writeBlocks(size_t num_blocks, size_t last_size);
+
+	protected:
+		int overflow(int c) override;
+
+	public:
+		BlockWriter(BlockWriter const&) = delete;
+		void operator=(BlockWriter const&) = delete;
+		BlockWriter(std::ostream & os, size_t num_threads);
+		~BlockWriter();
+
+		void finish();
+};
@@ -0,0 +1,84 @@
+#include "DatabaseView.hpp"
+#include "PostingCodec.hpp"
+
+template<typename KmerT>
+DatabaseView<KmerT>::DatabaseView(const std::string & filename, boophf<KmerT> * bphf, bool read_all, ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, ExpName2Id & exp_name2id, ExpId2ReadCount & exp_id2readcount) {
+	if(openFile(filename, bphf, read_all, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount)) return;
+	read_database(filename, initial_kmers, postings, bphf, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+	kmers = initial_kmers.data();
+	num_kmers = initial_kmers.size();
+	offsets = postings.offsets.data();
+	exp_ids = postings.exp_ids.data();
+	counts = postings.counts.data();
+	num_postings = postings.exp_ids.size();
+}
+
+template<typename KmerT>
+void DatabaseView<KmerT>::invalidOffset(KmerIndex index) const {
+	error("Invalid offset of k-mer index " + std::to_string(index + 1) + " in the database, file corruption detected.");
+	exit(EXIT_FAILURE);
+}
+
+template<typename KmerT>
+void DatabaseView<KmerT>::invalidPostings(KmerIndex index) const {
+	error("Invalid postings of k-mer index " + std::to_string(index) + " in the database, file corruption detected.");
+	exit(EXIT_FAILURE);
+}
+
+template<typename KmerT>
+ExperimentCount DatabaseView<KmerT>::numExperiments(KmerIndex index) const {
+	checkOffset(index);
+	if(encoded == nullptr) return static_cast<ExperimentCount>(offsets[index + 1] - offsets[index]);
+	ExperimentCount n = 0;
+	if(!decode_num_postings(encoded + offsets[index], offsets[index + 1] - offsets[index], n)) invalidPostings(index);
+	return n;
+}
+
+template<typename KmerT>
+typename DatabaseView<KmerT>::PostingList DatabaseView<KmerT>::postingList(KmerIndex index, PostingBuffer & buffer) const {
+	checkOffset(index);
+	if(encoded == nullptr) {
+		return PostingList{exp_ids + offsets[index], counts + offsets[index], static_cast<ExperimentCount>(offsets[index + 1] - offsets[index])};
+	}
+	const uint8_t * list = encoded + offsets[index];
+	const size_t size = offsets[index + 1] - offsets[index];
+	ExperimentCount n = 0;
+	if(!decode_num_postings(list, size, n)) invalidPostings(index);
+	if(buffer.exp_ids.size() < decode_capacity(n)) {
+		buffer.exp_ids.resize(decode_capacity(n));
+		buffer.counts.resize(decode_capacity(n));
+	}
+	if(!decode_postings(list, size, buffer.exp_ids.data(), buffer.counts.data())) invalidPostings(index);
+	return PostingList{buffer.exp_ids.data(), buffer.counts.data(), n};
+}
+
+/**
+* Opens the database file with DatabaseFile if it has the offset table and no
+* segments need to be added, and returns false otherwise.
+*/
+template<typename KmerT>
+bool DatabaseView<KmerT>::openFile(const std::string & filename, boophf<KmerT> * bphf, bool read_all, ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, ExpName2Id & exp_name2id, ExpId2ReadCount & exp_id2readcount) {
+	if(has_segments(filename)) return false;
+
+	std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+	if(!ifs) { error("Could not open file " + filename); exit(EXIT_FAILURE); }
+	const HeaderDbFile h_in = read_database_header(ifs);
+	// files in an older version are left to read_database()
+	if(h_in.dbVer < DB_VERSION_OFFSETS) return false;
+	ifs.close();
+
+	if(!(h_in.flags & DB_FLAG_BLOCKS)) std::cerr << getCurrentTime() << " Mapping database file " << filename << "\n";
+	file.reset(new DatabaseFile<KmerT>(filename, h_in, bphf, !read_all));
+	kmers = file->kmers;
+	num_kmers = file->num_kmers;
+	offsets = file->offsets;
+	exp_ids = file->exp_ids;
+	counts = file->counts;
+	encoded = file->encoded;
+	num_postings = file->num_postings;
+	file->readMetadata(exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+	return true;
+}
+
+template class DatabaseView<Kmer>;
+template class DatabaseView<Kmer128>;
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+#include "DatabaseFile.hpp"
+
+/**
+* Read-only access to the k-mers and postings of a database, for kiq query
+* and kiq dump. A database file with the offset table and without segment
+* log is memory-mapped, so that only the pages of the accessed k-mers are
+* read and concurrent processes share them in the page cache, or it is
+* decompressed into memory if it is compressed in blocks, see DatabaseFile.
+* Other databases are read into memory with read_database().
+*/
+template<typename KmerT>
+class DatabaseView {
+	public:
+		// the postings of a k-mer, sorted by experiment id
+		struct PostingList {
+			const ExperimentId * exp_ids;
+			const KmerCount * counts;
+			ExperimentCount size;
+		};
+		// memory for decoding compressed postings, one per thread
+		struct PostingBuffer {
+			std::vector<ExperimentId> exp_ids;
+			std::vector<KmerCount> counts;
+		};
+
+	private:
+		std::vector<KmerT> initial_kmers;
+		KmerPostings postings;
+		std::unique_ptr<DatabaseFile<KmerT>> file;
+		// sorted k-mers and postings in CSR layout indexed by MPHF index, see KmerPostings.
+		// The offsets of compressed postings are byte offsets into encoded.
+		const uint64_t * offsets = nullptr;
+		const ExperimentId * exp_ids = nullptr;
+		const KmerCount * counts = nullptr;
+		const uint8_t * encoded = nullptr;
+		uint64_t num_postings = 0;
+
+		[[noreturn]] void invalidOffset(KmerIndex index) const;
+		[[noreturn]] void invalidPostings(KmerIndex index) const;
+		bool openFile(const std::string & filename, boophf<KmerT> * bphf, bool read_all, ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, ExpName2Id & exp_name2id, ExpId2ReadCount & exp_id2readcount);
+
+		// the offsets of a database file are checked here instead of reading all of them when opening it
+		void checkOffset(KmerIndex index) const {
+			if(offsets[index + 1] < offsets[index] || offsets[index + 1] > num_postings) invalidOffset(index);
+		}
+
+	public:
+		const KmerT * kmers = nullptr;
+		uint64_t num_kmers = 0;
+
+		DatabaseView(DatabaseView const&) = delete;
+		void operator=(DatabaseView const&) = delete;
+		// read_all announces that all postings will be accessed, otherwise only few k-mers are looked up
+		DatabaseView(const std::string & filename, boophf<KmerT> * bphf, bool read_all, ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, ExpName2Id & exp_name2id, ExpId2ReadCount & exp_id2readcount);
+
+		ExperimentCount numExperiments(KmerIndex index) const;
+		// the postings of the k-mer, which are decoded into buffer if they are compressed
+		PostingList postingList(KmerIndex index, PostingBuffer & buffer) const;
+		bool contains(KmerT kmer) const { return std::binary_search(kmers, kmers + num_kmers, kmer); }
+};
@@ -0,0 +1,497 @@
+#include <string.h>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <deque>
+#include <memory>
+
+#include "Decompressor.hpp"
+#include "Inflater.hpp"
+
+void Decompressor::run() noexcept {
+	try {
+		doWork();
+	}
+	catch(std::exception & e) {
+		error_message = e.what();
+	}
+	queue.pushedLast();
+}
+
+void Decompressor::start() {
+	thread = std::thread(&Decompressor::run, this);
+}
+
+void Decompressor::join() {
+	if(thread.joinable()) thread.join();
+}
+
+static inline uint16_t get_uint16(const unsigned char * p) {
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_uint32(const unsigned char * p) {
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// returns the total size of the BGZF block from its header, or 0 if it is not a BGZF header
+static size_t bgzf_block_size(const unsigned char * header, const unsigned char * extra, size_t xlen) {
+	// gzip magic, deflate method and FEXTRA as only flag
+	if(header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || header[3] != 4) return 0;
+	size_t i = 0;
+	while(i + 4 <= xlen) {
+		const size_t slen = get_uint16(extra + i + 2);
+		if(extra[i] == 'B' && extra[i+1] == 'C' && slen == 2 && i + 6 <= xlen) {
+			return static_cast<size_t>(get_uint16(extra + i + 4)) + 1;
+		}
+		i += 4 + slen;
+	}
+	return 0;
+}
+
+static const uint32_t zstd_magic = 0xFD2FB528;
+
+// skippable frames can contain arbitrary data, e.g. the seek table of the zstd seekable format
+static inline bool is_zstd_skippable(uint32_t magic) {
+	return (magic & 0xFFFFFFF0) == 0x184D2A50;
+}
+
+Decompressor * Decompressor::open(const std::string & filename, RawChunkPool & pool, size_t num_threads) {
+	std::ifstream ifs(filename, std::ios::binary);
+	if(!ifs.good()) throw std::runtime_error("Could not open file " + filename);
+	unsigned char header[18];
+	ifs.read(reinterpret_cast<char *>(header), sizeof(header));
+	const size_t n = static_cast<size_t>(ifs.gcount());
+	if(n == sizeof(header) && get_uint16(header + 10) >= 6 && bgzf_block_size(header, header + 12, 6) > 0) {
+		return new BgzfDecompressor(filename, pool, num_threads);
+	}
+	if(n >= 4 && (get_uint32(header) == zstd_magic || is_zstd_skippable(get_uint32(header)))) {
+#ifdef KIQ_ZSTD
+		return new ZstdDecompressor(filename, pool, num_threads);
+#else
+		throw std::runtime_error("File " + filename + " is compressed with zstd, which requires compiling kiq with ZSTD=1");
+#endif
+	}
+	return new StreamDecompressor(filename, pool);
+}
+
+
+StreamDecompressor::StreamDecompressor(const std::string & filename, RawChunkPool & pool_) : Decompressor(pool_), ifs(filename, std::ios::binary), is(ifs) {
+	if(!ifs.good() || !is.good()) throw std::runtime_error("Could not open file " + filename);
+	start();
+}
+
+void StreamDecompressor::doWork() {
+	while(true) {
+		stall_timer.start();
+		RawChunk * chunk = pool.get();
+		stall_timer.stop();
+		is.read(chunk->data.data(), static_cast<std::streamsize>(chunk->data.size()));
+		chunk->size = static_cast<size_t>(is.gcount());
+		if(chunk->size == 0) {
+			pool.put(chunk);
+			break;
+		}
+		queue.push(chunk);
+		if(chunk->size < chunk->data.size()) break;
+	}
+}
+
+
+
+BlockDecompressor::BlockDecompressor(const std::string & filename, RawChunkPool & pool_, size_t num_threads_) : Decompressor(pool_), ifs(filename, std::ios::binary), num_threads(std::max(num_threads_, static_cast<size_t>(1))), max_jobs(2 * num_threads), job_pool(max_jobs) {
+	if(!ifs.good()) throw std::runtime_error("Could not open file " + filename);
+}
+
+void BlockDecompressor::Job::add(const std::vector<char> & block_data, Block block) {
+	block.offset += data.size();
+	data.insert(data.end(), block_data.begin(), block_data.end());
+	blocks.push_back(block);
+	total_size += block.size;
+}
+
+void BlockDecompressor::Job::clear() {
+	data.clear();
+	blocks.clear();
+	total_size = 0;
+	chunk = nullptr;
+	error_message.clear();
+	done = false;
+}
+
+void BlockDecompressor::Job::finish() {
+	std::lock_guard<std::mutex> job_lock(job_mutex);
+	done = true;
+	job_cv.notify_one();
+}
+
+void BlockDecompressor::Job::wait() {
+	std::unique_lock<std::mutex> job_lock(job_mutex);
+	job_cv.wait(job_lock, [this]{ return done; });
+}
+
+void BlockDecompressor::readExact(char * dst, size_t n, const char * format_name) {
+	ifs.read(dst, static_cast<std::streamsize>(n));
+	if(static_cast<size_t>(ifs.gcount()) != n) throw std::runtime_error(std::string(format_name) + " file truncated");
+}
+
+void BlockDecompressor::submitJob(Job * job) {
+	stall_timer.start();
+	job->chunk = pool.get();
+	stall_timer.stop();
+	job_queue->push(job);
+	jobs_in_flight.push_back(job);
+	if(jobs_in_flight.size() >= max_jobs) finishFrontJob();
+}
+
+void BlockDecompressor::finishFrontJob() {
+	Job * job = jobs_in_flight.front();
+	jobs_in_flight.pop_front();
+	stall_timer.start();
+	job->wait();
+	stall_timer.stop();
+	if(!job->error_message.empty()) {
+		const std::string e = job->error_message;
+		pool.put(job->chunk);
+		job_pool.put(job);
+		throw std::runtime_error(e);
+	}
+	queue.push(job->chunk);
+	job_pool.put(job);
+}
+
+void BlockDecompressor::finishJobs() {
+	while(!jobs_in_flight.empty()) finishFrontJob();
+}
+
+void BlockDecompressor::doWork() {
+	BoundedRingQueue<Job*> jobs(max_jobs);
+	job_queue = &jobs;
+	std::deque<std::thread> threads;
+	for(size_t i = 0; i < num_threads; i++) {
+		threads.push_back(std::thread(&BlockDecompressor::doWorkDecompress, this, &jobs));
+	}
+	try {
+		readBlocks();
+		finishJobs();
+	}
+	catch(std::exception &) {
+		// let the threads finish the submitted jobs before giving up
+		jobs.pushedLast();
+		for(auto & t : threads) t.join();
+		for(Job * job : jobs_in_flight) pool.put(job->chunk);
+		jobs_in_flight.clear();
+		throw;
+	}
+	jobs.pushedLast();
+	for(auto & t : threads) t.join();
+}
+
+
+BgzfDecompressor::BgzfDecompressor(const std::string & filename, RawChunkPool & pool_, size_t num_threads_) : BlockDecompressor(filename, pool_, num_threads_) {
+	start();
+}
+
+/**
+* Reads the next block from the file into data, which then contains the
+* deflate data followed by CRC and uncompressed size.
+* Returns false at the end of the file.
+*/
+bool BgzfDecompressor::readBlock(std::vector<char> & data, Block & block) {
+	unsigned char header[12];
+	ifs.read(reinterpret_cast<char *>(header), sizeof(header));
+	if(ifs.gcount() == 0) return false;
+	if(ifs.gcount() != sizeof(header)) throw std::runtime_error("BGZF block header truncated");
+	const size_t xlen = get_uint16(header + 10);
+	unsigned char extra[1 << 16];
+	readExact(reinterpret_cast<char *>(extra), xlen, "BGZF");
+	const size_t block_size = bgzf_block_size(header, extra, xlen);
+	if(block_size < sizeof(header) + xlen + 8) throw std::runtime_error("invalid BGZF block header");
+	const size_t remaining = block_size - sizeof(header) - xlen;
+	data.resize(remaining);
+	readExact(data.data(), remaining, "BGZF");
+	const unsigned char * trailer = reinterpret_cast<const unsigned char *>(data.data() + remaining - 8);
+	block.offset = 0;
+	block.length = remaining - 8;
+	block.crc = get_uint32(trailer);
+	block.size = get_uint32(trailer + 4);
+	if(block.size > (1 << 16)) throw std::runtime_error("invalid BGZF block size");
+	return true;
+}
+
+void BgzfDecompressor::readBlocks() {
+	std::vector<char> block_data;
+	Block block;
+	bool has_block = readBlock(block_data, block);
+	while(has_block) {
+		Job * job = job_pool.get();
+		// collect blocks until the decompressed data would not fit into one chunk
+		while(has_block && job->total_size + block.size < RawChunk::default_capacity) {
+			job->add(block_data, block);
+			has_block = readBlock(block_data, block);
+		}
+		submitJob(job);
+	}
+}
+
+void BgzfDecompressor::doWorkDecompress(BoundedRingQueue<Job*> * job_queue) noexcept {
+	std::unique_ptr<Inflater> inflater;
+	std::string init_error;
+	try {
+		inflater.reset(new Inflater());
+	}
+	catch(std::exception & e) {
+		init_error = e.what();
+	}
+	Job * job = nullptr;
+	while(job_queue->pop(job)) {
+		try {
+			if(!inflater) throw std::runtime_error(init_error);
+			RawChunk * chunk = job->chunk;
+			size_t out = 0;
+			for(const Block & block : job->blocks) {
+				char * dst = chunk->data.data() + out;
+				const size_t n = inflater->inflateRaw(job->data.data() + block.offset, block.length, dst, chunk->data.size() - out);
+				if(n != block.size) throw std::runtime_error("corrupt BGZF block");
+				if(Inflater::crc32(dst, n) != block.crc) throw std::runtime_error("CRC mismatch in BGZF block");
+				out += n;
+			}
+			chunk->size = out;
+		}
+		catch(std::exception & e) {
+			job->error_message = e.what();
+		}
+		job->finish();
+	}
+}
+
+
+#ifdef KIQ_ZSTD
+
+ZstdDecompressor::ZstdDecompressor(const std::string & filename, RawChunkPool & pool_, size_t num_threads_) : BlockDecompressor(filename, pool_, num_threads_) {
+	dstream = ZSTD_createDStream();
+	if(dstream == nullptr) throw std::runtime_error("zstd initialization failed");
+	start();
+}
+
+ZstdDecompressor::~ZstdDecompressor() {
+	join();
+	ZSTD_freeDStream(dstream);
+}
+
+/**
+* Reads the header of the next frame into data and skips skippable frames.
+* content_size is set to ZSTD_CONTENTSIZE_UNKNOWN if the header does not
+* contain the decompressed size. Returns false at the end of the file.
+*/
+bool ZstdDecompressor::readFrameHeader(std::vector<char> & data, uint64_t & content_size, bool & has_checksum) {
+	unsigned char magic[4];
+	while(true) {
+		ifs.read(reinterpret_cast<char *>(magic), sizeof(magic));
+		if(ifs.gcount() == 0) return false;
+		if(ifs.gcount() != sizeof(magic)) throw std::runtime_error("zstd file truncated");
+		if(!is_zstd_skippable(get_uint32(magic))) break;
+		unsigned char frame_size[4];
+		readExact(reinterpret_cast<char *>(frame_size), sizeof(frame_size), "zstd");
+		ifs.seekg(get_uint32(frame_size), std::ios::cur);
+	}
+	if(get_uint32(magic) != zstd_magic) throw std::runtime_error("invalid zstd frame");
+	unsigned char descriptor;
+	readExact(reinterpret_cast<char *>(&descriptor), 1, "zstd");
+	const unsigned fcs_flag = descriptor >> 6;
+	const bool single_segment = (descriptor >> 5) & 1;
+	has_checksum = (descriptor >> 2) & 1;
+	const size_t dict_id_sizes[4] = {0, 1, 2, 4};
+	const size_t fcs_sizes[4] = {single_segment ? 1u : 0u, 2, 4, 8};
+	const size_t window_size = single_segment ? 0 : 1;
+	const size_t dict_id_size = dict_id_sizes[descriptor & 3];
+	const size_t fcs_size = fcs_sizes[fcs_flag];
+	unsigned char rest[14];
+	readExact(reinterpret_cast<char *>(rest), window_size + dict_id_size + fcs_size, "zstd");
+	const unsigned char * fcs = rest + window_size + dict_id_size;
+	content_size = 0;
+	for(size_t i = 0; i < fcs_size; i++) content_size |= static_cast<uint64_t>(fcs[i]) << (8 * i);
+	if(fcs_size == 0) content_size = ZSTD_CONTENTSIZE_UNKNOWN;
+	else if(fcs_size == 2) content_size += 256;
+	data.insert(data.end(), magic, magic + sizeof(magic));
+	data.push_back(static_cast<char>(descriptor));
+	data.insert(data.end(), rest, rest + window_size + dict_id_size + fcs_size);
+	return true;
+}
+
+// appends the next block of the frame including its header to data, returns false after the last block
+bool ZstdDecompressor::readFrameBlock(std::vector<char> & data) {
+	unsigned char header[3];
+	readExact(reinterpret_cast<char *>(header), sizeof(header), "zstd");
+	const uint32_t h = static_cast<uint32_t>(header[0]) | (static_cast<uint32_t>(header[1]) << 8) | (static_cast<uint32_t>(header[2]) << 16);
+	const bool last = h & 1;
+	const unsigned type = (h >> 1) & 3;
+	if(type == 3) throw std::runtime_error("invalid zstd block");
+	// RLE blocks contain only the repeated byte
+	const size_t length = type == 1 ? 1 : h >> 3;
+	const size_t offset = data.size();
+	data.resize(offset + sizeof(header) + length);
+	memcpy(data.data() + offset, header, sizeof(header));
+	readExact(data.data() + offset + sizeof(header), length, "zstd");
+	return !last;
+}
+
+/**
+* Decompresses the frame whose header is in data while reading its blocks
+* from the file, and passes the decompressed data on in full chunks.
+*/
+void ZstdDecompressor::streamFrame(std::vector<char> & data, bool has_checksum) {
+	ZSTD_initDStream(dstream);
+	stall_timer.start();
+	RawChunk * chunk = pool.get();
+	stall_timer.stop();
+	bool more_blocks = true;
+	try {
+		while(true) {
+			const bool last_input = !more_blocks;
+			if(last_input && has_checksum) {
+				const size_t offset = data.size();
+				data.resize(offset + 4);
+				readExact(data.data() + offset, 4, "zstd");
+			}
+			ZSTD_inBuffer input = { data.data(), data.size(), 0 };
+			while(true) {
+				ZSTD_outBuffer output = { chunk->data.data(), chunk->data.size(), chunk->size };
+				const size_t ret = ZSTD_decompressStream(dstream, &output, &input);
+				if(ZSTD_isError(ret)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret));
+				chunk->size = output.pos;
+				if(chunk->size == chunk->data.size()) {
+					queue.push(chunk);
+					stall_timer.start();
+					chunk = pool.get();
+					stall_timer.stop();
+					continue;
+				}
+				if(input.pos < input.size) continue;
+				if(last_input && ret != 0) throw std::runtime_error("corrupt zstd frame");
+				break;
+			}
+			if(last_input) break;
+			data.clear();
+			more_blocks = readFrameBlock(data);
+		}
+	}
+	catch(std::exception &) {
+		pool.put(chunk);
+		throw;
+	}
+	if(chunk->size > 0) queue.push(chunk);
+	else pool.put(chunk);
+}
+
+// returns p and sets it to nullptr
+template<typename T>
+static inline T * release(T * & p) {
+	T * q = p;
+	p = nullptr;
+	return q;
+}
+
+void ZstdDecompressor::readBlocks() {
+	std::vector<char> frame;
+	uint64_t content_size = 0;
+	bool has_checksum = false;
+	Job * job = nullptr;
+	try {
+		while(true) {
+			frame.clear();
+			if(!readFrameHeader(frame, content_size, has_checksum)) break;
+			if(content_size != ZSTD_CONTENTSIZE_UNKNOWN && content_size < RawChunk::default_capacity) {
+				while(readFrameBlock(frame)) { }
+				if(has_checksum) {
+					const size_t offset = frame.size();
+					frame.resize(offset + 4);
+					readExact(frame.data() + offset, 4, "zstd");
+				}
+				if(job != nullptr && job->total_size + content_size >= RawChunk::default_capacity) {
+					submitJob(release(job));
+				}
+				if(job == nullptr) job = job_pool.get();
+				Block block = { 0, frame.size(), 0, static_cast<size_t>(content_size) };
+				job->add(frame, block);
+			}
+			else {
+				// frames that are larger than a chunk are streamed after all previous data was passed on
+				if(job != nullptr) submitJob(release(job));
+				finishJobs();
+				streamFrame(frame, has_checksum);
+			}
+		}
+		if(job != nullptr) submitJob(release(job));
+	}
+	catch(std::exception &) {
+		// jobs that were already submitted are cleaned up by BlockDecompressor::doWork()
+		if(job != nullptr) job_pool.put(job);
+		throw;
+	}
+}
+
+void ZstdDecompressor::doWorkDecompress(BoundedRingQueue<Job*> * job_queue) noexcept {
+	ZSTD_DCtx * dctx = ZSTD_createDCtx();
+	Job * job = nullptr;
+	while(job_queue->pop(job)) {
+		try {
+			if(dctx == nullptr) throw std::runtime_error("zstd initialization failed");
+			RawChunk * chunk = job->chunk;
+			size_t out = 0;
+			for(const Block & block : job->blocks) {
+				// verifies the checksum if the frame has one
+				const size_t n = ZSTD_decompressDCtx(dctx, chunk->data.data() + out, chunk->data.size() - out, job->data.data() + block.offset, block.length);
+				if(ZSTD_isError(n)) throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(n));
+				if(n != block.size) throw std::runtime_error("corrupt zstd frame");
+				out += n;
+			}
+			chunk->size = out;
+		}
+		catch(std::exception & e) {
+			job->error_message = e.what();
+		}
+		job->finish();
+	}
+	ZSTD_freeDCtx(dctx);
+}
+
+#endif
+
+
+ChunkQueueSource::~ChunkQueueSource() {
+	if(chunk != nullptr) pool.put(chunk);
+}
+
+void ChunkQueueSource::discard() {
+	if(chunk != nullptr) pool.put(chunk);
+	while(queue.pop(chunk)) {
+		pool.put(chunk);
+	}
+	chunk = nullptr;
+}
+
+size_t ChunkQueueSource::read(char * dst, size_t n) {
+	size_t copied = 0;
+	while(copied < n) {
+		if(chunk == nullptr) {
+			stall_timer.start();
+			const bool ok = queue.pop(chunk);
+			stall_timer.stop();
+			if(!ok) {
+				chunk = nullptr;
+				break;
+			}
+			chunk_pos = 0;
+		}
+		const size_t k = std::min(n - copied, chunk->size - chunk_pos);
+		memcpy(dst + copied, chunk->data.data() + chunk_pos, k);
+		copied += k;
+		chunk_pos += k;
+		if(chunk_pos == chunk->size) {
+			pool.put(chunk);
+			chunk = nullptr;
+		}
+	}
+	return copied;
+}
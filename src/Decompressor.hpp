@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <istream>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+#include "zstr/zstr.hpp"
+#ifdef KIQ_ZSTD
+#include <zstd.h>
+#endif
+#include "ProducerConsumerQueue/BoundedRingQueue.hpp"
+#include "FastxParser.hpp"
+#include "Pool.hpp"
+#include "util.hpp"
+
+/**
+* A chunk of decompressed data from an input file.
+*/
+class RawChunk {
+	public:
+		static const size_t default_capacity = 1 << 22;
+		std::vector<char> data;
+		size_t size = 0;
+		RawChunk(RawChunk const&) = delete;
+		void operator=(RawChunk const&) = delete;
+		RawChunk() : data(default_capacity) { }
+		void clear() { size = 0; }
+};
+
+using RawChunkPool = Pool<RawChunk>;
+using chunk_queue_t = BoundedRingQueue<RawChunk*>;
+
+/**
+* Reads an input file in a separate thread and passes the decompressed data
+* in chunks to a queue, so that decompression runs concurrently with parsing.
+* Decompressor::open() chooses the implementation for the file format.
+*/
+class Decompressor {
+	protected:
+		RawChunkPool & pool;
+		chunk_queue_t queue;
+		std::thread thread;
+		std::string error_message;
+		StallTimer stall_timer;
+
+		// runs in the thread and reads the whole file, errors are thrown as exceptions
+		virtual void doWork() = 0;
+		void run() noexcept;
+		// must be called at the end of the constructor of the derived classes
+		void start();
+
+	public:
+		Decompressor(Decompressor const&) = delete;
+		void operator=(Decompressor const&) = delete;
+		Decompressor(RawChunkPool & pool_) : pool(pool_), queue(pool_.size()) { }
+		// derived classes must call join() in their destructor
+		virtual ~Decompressor() { }
+
+		// the pool should have at least 2 * num_threads + 2 chunks
+		static Decompressor * open(const std::string & filename, RawChunkPool & pool, size_t num_threads);
+
+		chunk_queue_t & chunks() { return queue; }
+		void join();
+		const std::string & errorMessage() const { return error_message; }
+		// time spent waiting for free chunks or for helper threads
+		double stallSeconds() const { return stall_timer.seconds(); }
+};
+
+/**
+* Decompresses gzip or plain files sequentially with zstr.
+*/
+class StreamDecompressor : public Decompressor {
+	private:
+		std::ifstream ifs;
+		zstr::istream is;
+
+		void doWork();
+
+	public:
+		StreamDecompressor(const std::string & filename, RawChunkPool & pool_);
+		~StreamDecompressor() { join(); }
+};
+
+/**
+* Base class for formats consisting of independently compressed blocks.
+* The derived classes read the blocks in doWork() and collect them into
+* jobs, which are decompressed by a pool of threads running
+* doWorkDecompress(). The resulting chunks are passed on in the order of
+* the file.
+*/
+class BlockDecompressor : public Decompressor {
+	protected:
+		struct Block {
+			size_t offset; // of the compressed data in Job::data
+			size_t length;
+			uint32_t crc;
+			size_t size; // decompressed size
+		};
+		struct Job {
+			std::vector<char> data;
+			std::vector<Block> blocks;
+			size_t total_size = 0; // decompressed size of all blocks, must fit into one chunk
+			RawChunk * chunk = nullptr;
+			std::string error_message;
+			bool done = false;
+			std::mutex job_mutex;
+			std::condition_variable job_cv;
+			void add(const std::vector<char> & block_data, Block block);
+			void clear();
+			void finish();
+			void wait();
+		};
+
+		std::ifstream ifs;
+		size_t num_threads;
+		size_t max_jobs;
+		Pool<Job> job_pool;
+
+		// reads the file and passes the jobs to submitJob()
+		virtual void readBlocks() = 0;
+		// decompresses the jobs from the queue until pushedLast() was called
+		virtual void doWorkDecompress(BoundedRingQueue<Job*> * job_queue) noexcept = 0;
+		void submitJob(Job * job);
+		// waits until all submitted jobs are passed on
+		void finishJobs();
+		void readExact(char * dst, size_t n, const char * format_name);
+
+	private:
+		BoundedRingQueue<Job*> * job_queue = nullptr;
+		std::deque<Job *> jobs_in_flight;
+		void finishFrontJob();
+		void doWork();
+
+	public:
+		BlockDecompressor(const std::string & filename, RawChunkPool & pool_, size_t num_threads_);
+};
+
+/**
+* Decompresses BGZF files, which consist of gzip members of at most 64 kB
+* that carry their compressed size in the extra field of the header.
+*/
+class BgzfDecompressor : public BlockDecompressor {
+	private:
+		bool readBlock(std::vector<char> & data, Block & block);
+		void readBlocks();
+		void doWorkDecompress(BoundedRingQueue<Job*> * job_queue) noexcept;
+
+	public:
+		BgzfDecompressor(const std::string & filename, RawChunkPool & pool_, size_t num_threads_);
+		~BgzfDecompressor() { join(); }
+};
+
+#ifdef KIQ_ZSTD
+/**
+* Decompresses zstd files. Frames with a known decompressed size that fits
+* into one chunk are decompressed in parallel, as written by pzstd or
+* zstd --seekable. Larger frames, e.g. from the zstd command line tool, are
+* streamed in this thread.
+*/
+class ZstdDecompressor : public BlockDecompressor {
+	private:
+		ZSTD_DStream * dstream = nullptr;
+
+		bool readFrameHeader(std::vector<char> & data, uint64_t & content_size, bool & has_checksum);
+		bool readFrameBlock(std::vector<char> & data);
+		void streamFrame(std::vector<char> & data, bool has_checksum);
+		void readBlocks();
+		void doWorkDecompress(BoundedRingQueue<Job*> * job_queue) noexcept;
+
+	public:
+		ZstdDecompressor(const std::string & filename, RawChunkPool & pool_, size_t num_threads_);
+		~ZstdDecompressor();
+};
+#endif
+
+/**
+* FastxSource that copies the data from the chunks of a Decompressor.
+*/
+class ChunkQueueSource : public FastxSource {
+	private:
+		chunk_queue_t & queue;
+		RawChunkPool & pool;
+		RawChunk * chunk = nullptr;
+		size_t chunk_pos = 0;
+		StallTimer stall_timer;
+
+	public:
+		ChunkQueueSource(ChunkQueueSource const&) = delete;
+		void operator=(ChunkQueueSource const&) = delete;
+		ChunkQueueSource(chunk_queue_t & queue_, RawChunkPool & pool_) : queue(queue_), pool(pool_) { }
+		~ChunkQueueSource();
+		size_t read(char * dst, size_t n);
+		// returns all remaining chunks to the pool, so that the Decompressor can finish
+		void discard();
+		// time spent waiting for decompressed data
+		double stallSeconds() const { return stall_timer.seconds(); }
+};
@@ -0,0 +1,64 @@
+#include <string.h>
+#include <stdexcept>
+
+#include "Deflater.hpp"
+
+#ifdef KIQ_LIBDEFLATE
+
+Deflater::Deflater(int level) {
+	compressor = libdeflate_alloc_compressor(level);
+	if(compressor == nullptr) throw std::runtime_error("libdeflate initialization failed");
+}
+
+Deflater::~Deflater() {
+	libdeflate_free_compressor(compressor);
+}
+
+size_t Deflater::bound(size_t src_length) {
+	return libdeflate_deflate_compress_bound(compressor, src_length);
+}
+
+size_t Deflater::deflateRaw(const char * src, size_t src_length, char * dst, size_t dst_capacity) {
+	const size_t out = libdeflate_deflate_compress(compressor, src, src_length, dst, dst_capacity);
+	if(out == 0) throw std::runtime_error("compressed data exceeds buffer");
+	return out;
+}
+
+#else
+
+Deflater::Deflater(int level) {
+	memset(&strm, 0, sizeof(strm));
+	// negative window bits for raw deflate data without header
+	if(deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) throw std::runtime_error("zlib initialization failed");
+}
+
+Deflater::~Deflater() {
+	deflateEnd(&strm);
+}
+
+size_t Deflater::bound(size_t src_length) {
+	return deflateBound(&strm, static_cast<uLong>(src_length));
+}
+
+// zlib can only take 32 bit lengths, like in Inflater.cpp
+size_t Deflater::deflateRaw(const char * src, size_t src_length, char * dst, size_t dst_capacity) {
+	deflateReset(&strm);
+	strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+	strm.next_out = reinterpret_cast<Bytef *>(dst);
+	size_t in_left = src_length, out_left = dst_capacity;
+	int ret = Z_OK;
+	while(ret == Z_OK) {
+		const uInt max_len = 1u << 30;
+		strm.avail_in = static_cast<uInt>(in_left < max_len ? in_left : max_len);
+		strm.avail_out = static_cast<uInt>(out_left < max_len ? out_left : max_len);
+		const uInt avail_in = strm.avail_in, avail_out = strm.avail_out;
+		ret = deflate(&strm, in_left <= max_len ? Z_FINISH : Z_NO_FLUSH);
+		in_left -= avail_in - strm.avail_in;
+		out_left -= avail_out - strm.avail_out;
+		if(out_left == 0 && ret != Z_STREAM_END) throw std::runtime_error("compressed data exceeds buffer");
+	}
+	if(ret != Z_STREAM_END) throw std::runtime_error("deflate failed");
+	return dst_capacity - out_left;
+}
+
+#endif
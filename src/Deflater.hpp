@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef KIQ_LIBDEFLATE
+#include <libdeflate.h>
+#else
+#include <zlib.h>
+#endif
+
+/**
+* Compresses data from memory into raw deflate streams, the counterpart of
+* Inflater::inflateRaw(). The backend is chosen at build time like for the
+* Inflater: libdeflate when compiled with KIQ_LIBDEFLATE, otherwise zlib.
+* Errors are thrown as std::runtime_error.
+*/
+class Deflater {
+	private:
+#ifdef KIQ_LIBDEFLATE
+		libdeflate_compressor * compressor = nullptr;
+#else
+		z_stream strm;
+#endif
+
+	public:
+		Deflater(Deflater const&) = delete;
+		void operator=(Deflater const&) = delete;
+		explicit Deflater(int level = 6);
+		~Deflater();
+
+		// the maximum compressed size of src_length bytes
+		size_t bound(size_t src_length);
+		// compresses src into dst, which must have room for bound(src_length) bytes, and returns the compressed size
+		size_t deflateRaw(const char * src, size_t src_length, char * dst, size_t dst_capacity);
+};
@@ -0,0 +1,241 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdexcept>
+
+#include "FastxParser.hpp"
+
+static inline bool is_space(const char c) {
+	return c == '\n' || c == '\r' || c == ' ' || c == '\t';
+}
+
+// removes all whitespace from [begin, end) in place and returns the new length
+static size_t remove_space(char * begin, char * end) {
+	char * w = begin;
+	while(w < end && !is_space(*w)) w++;
+	for(const char * r = w; r < end; r++) {
+		if(!is_space(*r)) *w++ = *r;
+	}
+	return static_cast<size_t>(w - begin);
+}
+
+size_t IstreamSource::read(char * dst, size_t n) {
+	is.read(dst, static_cast<std::streamsize>(n));
+	return static_cast<size_t>(is.gcount());
+}
+
+FileSource::FileSource(const std::string & filename, uint64_t offset_) : offset(offset_) {
+	fd = open(filename.c_str(), O_RDONLY);
+	if(fd < 0) throw std::runtime_error("Could not open file " + filename);
+}
+
+FileSource::~FileSource() {
+	close(fd);
+}
+
+size_t FileSource::read(char * dst, size_t n) {
+	ssize_t r;
+	do {
+		r = pread(fd, dst, n, static_cast<off_t>(offset));
+	} while(r < 0 && errno == EINTR);
+	if(r < 0) throw std::runtime_error("Error while reading file");
+	offset += static_cast<uint64_t>(r);
+	return static_cast<size_t>(r);
+}
+
+FastxParser::FastxParser(FastxSource & source_, size_t buffer_size) : source(source_), buffer(buffer_size) { }
+
+/**
+* Moves the unparsed data to the front of the buffer and appends new data
+* from the source. The buffer is enlarged when the current record fills it
+* completely. Returns false at the end of the input.
+*/
+bool FastxParser::fill() {
+	if(eof) return false;
+	if(pos > 0) {
+		memmove(buffer.data(), buffer.data() + pos, end - pos);
+		buffer_offset += pos;
+		end -= pos;
+		pos = 0;
+	}
+	if(end == buffer.size()) {
+		buffer.resize(buffer.size() * 2);
+	}
+	const size_t n = source.read(buffer.data() + end, buffer.size() - end);
+	if(n == 0) {
+		eof = true;
+		return false;
+	}
+	end += n;
+	return true;
+}
+
+void FastxParser::detectFormat() {
+	if(buffer[pos] == '@') format = Format::fastq;
+	else if(buffer[pos] == '>') format = Format::fasta;
+	else throw std::runtime_error("Auto-detection of file type failed");
+}
+
+bool FastxParser::next(const char * & seq, size_t & length) {
+	while(true) {
+		// skip empty lines between records
+		while(pos < end && buffer[pos] == '\n') pos++;
+		if(pos == end) {
+			if(!fill()) return false;
+			continue;
+		}
+		if(buffer_offset + pos >= limit) return false;
+		if(format == Format::unknown) detectFormat();
+		const bool complete = format == Format::fastq ? parseFastq(seq, length) : parseFasta(seq, length);
+		if(complete) return true;
+		fill();
+	}
+}
+
+/**
+* Each FASTQ record has four lines: header, sequence, separator and quality scores.
+* Returns false if the record is not completely contained in the buffer.
+*/
+bool FastxParser::parseFastq(const char * & seq, size_t & length) {
+	char * const data = buffer.data();
+	size_t seq_start = end, seq_end = end;
+	size_t p = pos;
+	int line = 0;
+	for(; line < 4 && p < end; line++) {
+		const char * nl = static_cast<const char *>(memchr(data + p, '\n', end - p));
+		if(nl == nullptr && !eof) return false;
+		const size_t line_end = nl == nullptr ? end : static_cast<size_t>(nl - data);
+		if(line == 1) {
+			seq_start = p;
+			seq_end = line_end;
+		}
+		p = nl == nullptr ? end : line_end + 1;
+	}
+	if(line < 4 && !eof) return false;
+	pos = p;
+	length = remove_space(data + seq_start, data + seq_end);
+	seq = data + seq_start;
+	return true;
+}
+
+/**
+* A FASTA record spans from its header line until the next line starting with '>'.
+* Returns false if the record is not completely contained in the buffer.
+*/
+bool FastxParser::parseFasta(const char * & seq, size_t & length) {
+	char * const data = buffer.data();
+	size_t record_end = end;
+	size_t p = pos;
+	while(true) {
+		const char * nl = static_cast<const char *>(memchr(data + p, '\n', end - p));
+		if(nl == nullptr) {
+			if(!eof) return false;
+			break;
+		}
+		p = static_cast<size_t>(nl - data) + 1;
+		if(p == end) {
+			// the next record may start with the next chunk of data
+			if(!eof) return false;
+			break;
+		}
+		if(data[p] == '>') {
+			record_end = p;
+			break;
+		}
+	}
+	const char * nl = static_cast<const char *>(memchr(data + pos, '\n', record_end - pos));
+	const size_t seq_start = nl == nullptr ? record_end : static_cast<size_t>(nl - data) + 1;
+	pos = record_end;
+	length = remove_space(data + seq_start, data + record_end);
+	seq = data + seq_start;
+	return true;
+}
+
+// returns the start of the line after the one containing p, or npos if more data is needed
+size_t FastxParser::nextLine(size_t p) const {
+	const char * nl = static_cast<const char *>(memchr(buffer.data() + p, '\n', end - p));
+	if(nl != nullptr) return static_cast<size_t>(nl - buffer.data()) + 1;
+	return eof ? end : npos;
+}
+
+/**
+* Checks if the line starting at p is the first line of a record.
+* FASTQ records are recognized by a line starting with '@' that is followed by
+* a line starting with '+' two lines later, which excludes quality score lines
+* starting with '@'.
+* Returns 1 or 0, or -1 if more data is needed.
+* A last record consisting only of a header line is not recognized.
+*/
+int FastxParser::isRecordStart(size_t p) const {
+	const char * data = buffer.data();
+	if(format == Format::fasta) return data[p] == '>' ? 1 : 0;
+	if(data[p] != '@') return 0;
+	const size_t line2 = nextLine(p);
+	if(line2 == npos) return -1;
+	if(line2 == end) return 0;
+	const size_t line3 = nextLine(line2);
+	if(line3 == npos) return -1;
+	// a truncated last record ends after the sequence line, which cannot start with '@'
+	if(line3 == end) return data[line2] != '@' ? 1 : 0;
+	return data[line3] == '+' ? 1 : 0;
+}
+
+/**
+* Skips the partial line at the beginning of the data and all following lines
+* until the first line that starts a record.
+* Returns false if there is no record before the limit.
+*/
+bool FastxParser::syncToRecord() {
+	if(format == Format::unknown) throw std::runtime_error("File type must be set for parsing parts of a file");
+	bool line_start = false;
+	while(true) {
+		if(pos == end) {
+			if(!fill()) return false;
+			continue;
+		}
+		if(buffer_offset + pos >= limit) return false;
+		if(!line_start) {
+			const size_t p = nextLine(pos);
+			if(p == npos) {
+				pos = end;
+				continue;
+			}
+			pos = p;
+			line_start = true;
+			continue;
+		}
+		const int r = isRecordStart(pos);
+		if(r < 0) {
+			fill();
+			continue;
+		}
+		if(r == 1) return true;
+		line_start = false;
+	}
+}
+
+bool is_plain_fastx(const std::string & filename, uint64_t & file_size, bool & fastq) {
+	struct stat st;
+	if(stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+	file_size = static_cast<uint64_t>(st.st_size);
+	char head[4096];
+	size_t n = 0;
+	try {
+		FileSource source(filename, 0);
+		n = source.read(head, sizeof(head));
+	}
+	catch(std::runtime_error &) {
+		return false;
+	}
+	// gzip magic bytes
+	if(n >= 2 && static_cast<unsigned char>(head[0]) == 0x1f && static_cast<unsigned char>(head[1]) == 0x8b) return false;
+	size_t i = 0;
+	while(i < n && head[i] == '\n') i++;
+	if(i == n) return false;
+	if(head[i] == '@') fastq = true;
+	else if(head[i] == '>') fastq = false;
+	else return false;
+	return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <istream>
+#include <string>
+#include <vector>
+#include <limits>
+
+/**
+* Source of raw bytes for the FastxParser.
+*/
+class FastxSource {
+	public:
+		virtual ~FastxSource() {}
+		// reads up to n bytes into dst and returns the number of bytes read, 0 at end of input
+		virtual size_t read(char * dst, size_t n) = 0;
+};
+
+class IstreamSource : public FastxSource {
+	private:
+		std::istream & is;
+
+	public:
+		IstreamSource(std::istream & is_) : is(is_) { }
+		size_t read(char * dst, size_t n);
+};
+
+/**
+* Reads a file with pread(), starting at a given offset until the end of the file.
+*/
+class FileSource : public FastxSource {
+	private:
+		int fd;
+		uint64_t offset;
+
+	public:
+		FileSource(FileSource const&) = delete;
+		void operator=(FileSource const&) = delete;
+		FileSource(const std::string & filename, uint64_t offset_);
+		~FileSource();
+		size_t read(char * dst, size_t n);
+};
+
+/**
+* Parser for FASTA and FASTQ files, which reads large chunks from a FastxSource
+* into its buffer and finds line breaks with memchr.
+* Sequences are returned as pointers into the buffer, which are valid until the
+* next call of next(). Whitespace, including the line breaks of multi-line
+* FASTA entries, is removed from a sequence by moving the remaining characters
+* within the buffer. All other characters are kept, so that k-mers spanning
+* ambiguous bases or gaps can be skipped when counting.
+* The file type is detected from the first non-empty line.
+*
+* For parsing only a part of a file, the parser can skip to the first record
+* in the data with syncToRecord() and stop at the first record that starts
+* at or after a given offset.
+*/
+class FastxParser {
+	private:
+		enum class Format { unknown, fasta, fastq };
+
+		FastxSource & source;
+		std::vector<char> buffer;
+		size_t pos = 0; // start of the next record in buffer
+		size_t end = 0; // end of data in buffer
+		uint64_t buffer_offset = 0; // offset of the buffer start in the source
+		uint64_t limit = std::numeric_limits<uint64_t>::max();
+		bool eof = false;
+		Format format = Format::unknown;
+
+		static const size_t npos = std::numeric_limits<size_t>::max();
+
+		bool fill();
+		size_t nextLine(size_t p) const;
+		int isRecordStart(size_t p) const;
+		void detectFormat();
+		bool parseFastq(const char * & seq, size_t & length);
+		bool parseFasta(const char * & seq, size_t & length);
+
+	public:
+		static const size_t default_buffer_size = 1 << 22;
+		FastxParser(FastxParser const&) = delete;
+		void operator=(FastxParser const&) = delete;
+		FastxParser(FastxSource & source_, size_t buffer_size = default_buffer_size);
+
+		// returns false when there are no more records, throws std::runtime_error if the file type is not recognized
+		bool next(const char * & seq, size_t & length);
+		bool isFastQ() const { return format == Format::fastq; }
+		void setFormat(bool fastq) { format = fastq ? Format::fastq : Format::fasta; }
+		// next() returns false for records starting at or after this offset in the source
+		void setLimit(uint64_t limit_) { limit = limit_; }
+		bool syncToRecord();
+		// offset of the next record in the source
+		uint64_t offset() const { return buffer_offset + pos; }
+};
+
+// checks if a file is an uncompressed FASTA/Q file and determines its size and type
+bool is_plain_fastx(const std::string & filename, uint64_t & file_size, bool & fastq);
@@ -0,0 +1,110 @@
+#include <string.h>
+#include <stdexcept>
+
+#include "Inflater.hpp"
+
+#ifdef KIQ_LIBDEFLATE
+
+Inflater::Inflater() {
+	decompressor = libdeflate_alloc_decompressor();
+	if(decompressor == nullptr) throw std::runtime_error("libdeflate initialization failed");
+}
+
+Inflater::~Inflater() {
+	libdeflate_free_decompressor(decompressor);
+}
+
+static void check_result(libdeflate_result result) {
+	if(result == LIBDEFLATE_INSUFFICIENT_SPACE) throw std::runtime_error("decompressed data exceeds buffer");
+	if(result != LIBDEFLATE_SUCCESS) throw std::runtime_error("corrupt deflate data");
+}
+
+size_t Inflater::inflateRaw(const char * src, size_t src_length, char * dst, size_t dst_capacity) {
+	size_t out = 0;
+	check_result(libdeflate_deflate_decompress(decompressor, src, src_length, dst, dst_capacity, &out));
+	return out;
+}
+
+size_t Inflater::inflateGzip(const char * src, size_t src_length, char * dst, size_t dst_capacity, size_t & consumed) {
+	size_t out = 0;
+	check_result(libdeflate_gzip_decompress_ex(decompressor, src, src_length, dst, dst_capacity, &consumed, &out));
+	return out;
+}
+
+uint32_t Inflater::crc32(const char * data, size_t length, uint32_t crc) {
+	return libdeflate_crc32(crc, data, length);
+}
+
+const char * Inflater::backend() {
+	return "libdeflate";
+}
+
+#else
+
+Inflater::Inflater() {
+	memset(&strm, 0, sizeof(strm));
+	memset(&gzip_strm, 0, sizeof(gzip_strm));
+	// negative window bits for raw deflate data without header
+	if(inflateInit2(&strm, -15) != Z_OK) throw std::runtime_error("zlib initialization failed");
+}
+
+Inflater::~Inflater() {
+	inflateEnd(&strm);
+	if(gzip_initialized) inflateEnd(&gzip_strm);
+}
+
+// decompresses one complete stream, zlib can only take 32 bit lengths
+static size_t inflate_stream(z_stream & s, const char * src, size_t src_length, char * dst, size_t dst_capacity) {
+	s.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+	s.next_out = reinterpret_cast<Bytef *>(dst);
+	size_t in_left = src_length, out_left = dst_capacity;
+	int ret = Z_OK;
+	while(ret == Z_OK) {
+		const uInt max_len = 1u << 30;
+		s.avail_in = static_cast<uInt>(in_left < max_len ? in_left : max_len);
+		s.avail_out = static_cast<uInt>(out_left < max_len ? out_left : max_len);
+		const uInt avail_in = s.avail_in, avail_out = s.avail_out;
+		ret = inflate(&s, Z_NO_FLUSH);
+		in_left -= avail_in - s.avail_in;
+		out_left -= avail_out - s.avail_out;
+		if(ret == Z_BUF_ERROR && out_left == 0) throw std::runtime_error("decompressed data exceeds buffer");
+	}
+	if(ret != Z_STREAM_END) throw std::runtime_error("corrupt deflate data");
+	return dst_capacity - out_left;
+}
+
+size_t Inflater::inflateRaw(const char * src, size_t src_length, char * dst, size_t dst_capacity) {
+	inflateReset(&strm);
+	return inflate_stream(strm, src, src_length, dst, dst_capacity);
+}
+
+size_t Inflater::inflateGzip(const char * src, size_t src_length, char * dst, size_t dst_capacity, size_t & consumed) {
+	if(!gzip_initialized) {
+		// window bits + 16 for the gzip format
+		if(inflateInit2(&gzip_strm, 15 + 16) != Z_OK) throw std::runtime_error("zlib initialization failed");
+		gzip_initialized = true;
+	}
+	else {
+		inflateReset(&gzip_strm);
+	}
+	const size_t out = inflate_stream(gzip_strm, src, src_length, dst, dst_capacity);
+	consumed = static_cast<size_t>(reinterpret_cast<const char *>(gzip_strm.next_in) - src);
+	return out;
+}
+
+uint32_t Inflater::crc32(const char * data, size_t length, uint32_t crc) {
+	uLong z_crc = crc;
+	while(length > 0) {
+		const uInt n = static_cast<uInt>(length < (1u << 30) ? length : (1u << 30));
+		z_crc = ::crc32(z_crc, reinterpret_cast<const Bytef *>(data), n);
+		data += n;
+		length -= n;
+	}
+	return static_cast<uint32_t>(z_crc);
+}
+
+const char * Inflater::backend() {
+	return "zlib";
+}
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef KIQ_LIBDEFLATE
+#include <libdeflate.h>
+#else
+#include <zlib.h>
+#endif
+
+/**
+* Decompresses complete deflate streams or gzip members from memory into an
+* output buffer of sufficient size.
+* The backend is chosen at build time: libdeflate when compiled with
+* KIQ_LIBDEFLATE (see makefile), otherwise zlib.
+* Errors are thrown as std::runtime_error.
+*/
+class Inflater {
+	private:
+#ifdef KIQ_LIBDEFLATE
+		libdeflate_decompressor * decompressor = nullptr;
+#else
+		z_stream strm;
+		z_stream gzip_strm;
+		bool gzip_initialized = false;
+#endif
+
+	public:
+		Inflater(Inflater const&) = delete;
+		void operator=(Inflater const&) = delete;
+		Inflater();
+		~Inflater();
+
+		// decompresses raw deflate data and returns the decompressed size
+		size_t inflateRaw(const char * src, size_t src_length, char * dst, size_t dst_capacity);
+		// decompresses the gzip member at the beginning of src, returns the decompressed size
+		// and sets consumed to the length of the member
+		size_t inflateGzip(const char * src, size_t src_length, char * dst, size_t dst_capacity, size_t & consumed);
+		// continues the CRC-32 crc of the preceding data
+		static uint32_t crc32(const char * data, size_t length, uint32_t crc = 0);
+		static const char * backend();
+};
@@ -0,0 +1,77 @@
+#include "IngestPostings.hpp"
+
+const size_t PostingArena::block_size;
+const uint32_t IngestPostings::min_chunk_capacity;
+const uint32_t IngestPostings::max_chunk_capacity;
+
+void * PostingArena::allocate(size_t bytes) {
+	// chunks are kept aligned to 8 bytes for their pointer
+	bytes = (bytes + 7) & ~static_cast<size_t>(7);
+	if(bytes > left) {
+		const size_t size = std::max(bytes, block_size);
+		blocks.emplace_back(new char[size]);
+		next = blocks.back().get();
+		left = size;
+	}
+	void * p = next;
+	next += bytes;
+	left -= bytes;
+	return p;
+}
+
+IngestPostings::IngestPostings(KmerIndex n_elem, size_t num_arenas) : tails(n_elem, nullptr) {
+	arenas.resize(num_arenas);
+}
+
+IngestPostings::Chunk * IngestPostings::newChunk(KmerIndex index, uint32_t capacity, size_t arena) {
+	Chunk * c = static_cast<Chunk *>(arenas[arena].allocate(sizeof(Chunk) + capacity * sizeof(Posting)));
+	c->prev = tails[index];
+	c->size = 0;
+	c->capacity = capacity;
+	tails[index] = c;
+	return c;
+}
+
+void IngestPostings::reserve(KmerIndex index, ExperimentCount n, size_t arena) {
+	const Chunk * tail = tails[index];
+	if(tail != nullptr && tail->capacity - tail->size >= n) return;
+	newChunk(index, std::max(n, min_chunk_capacity), arena);
+}
+
+void IngestPostings::add(KmerIndex index, ExperimentId exp_id, KmerCount count, size_t arena) {
+	Chunk * tail = tails[index];
+	if(tail != nullptr && tail->size > 0) {
+		Posting & last = tail->postings()[tail->size - 1];
+		if(last.exp_id == exp_id) {
+			last.count += count;
+			return;
+		}
+		if(exp_id < last.exp_id) {
+			// a sample of an existing experiment
+			for(Chunk * c = tail; c != nullptr; c = c->prev) {
+				for(uint32_t i = 0; i < c->size; i++) {
+					if(c->postings()[i].exp_id == exp_id) {
+						c->postings()[i].count += count;
+						return;
+					}
+				}
+			}
+			unsorted.store(true, std::memory_order_relaxed);
+		}
+	}
+	if(tail == nullptr) {
+		tail = newChunk(index, min_chunk_capacity, arena);
+	}
+	else if(tail->size == tail->capacity) {
+		tail = newChunk(index, std::min(2 * tail->capacity, max_chunk_capacity), arena);
+	}
+	tail->postings()[tail->size++] = Posting{exp_id, count};
+}
+
+ExperimentCount IngestPostings::numExperiments(KmerIndex index) const {
+	ExperimentCount n = 0;
+	for(const Chunk * c = tails[index]; c != nullptr; c = c->prev) {
+		n += c->size;
+	}
+	return n;
+}
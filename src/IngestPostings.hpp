@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+#include "util.hpp"
+
+/**
+* Hands out memory from large blocks by advancing a pointer. The memory is
+* only released as a whole when the arena is destroyed.
+*/
+class PostingArena {
+	private:
+		std::vector<std::unique_ptr<char[]>> blocks;
+		char * next = nullptr;
+		size_t left = 0;
+
+	public:
+		static const size_t block_size = 1 << 24;
+		PostingArena() = default;
+		PostingArena(PostingArena &&) = default;
+		PostingArena(PostingArena const&) = delete;
+		void operator=(PostingArena const&) = delete;
+
+		void * allocate(size_t bytes);
+};
+
+/**
+* Experiment ids and counts of all k-mers while samples are added to the
+* database. The postings of each k-mer are stored in a list of chunks, which
+* are allocated from arenas and grow in size along the list. New experiments
+* get the highest id so far, therefore their counts are appended to the last
+* chunk and the postings stay sorted without moving them.
+*/
+class IngestPostings {
+	public:
+		struct Posting {
+			ExperimentId exp_id;
+			KmerCount count;
+		};
+
+	private:
+		// the postings of a chunk follow directly after its header
+		struct Chunk {
+			Chunk * prev;
+			uint32_t size;
+			uint32_t capacity;
+			Posting * postings() { return reinterpret_cast<Posting *>(this + 1); }
+			const Posting * postings() const { return reinterpret_cast<const Posting *>(this + 1); }
+		};
+		static const uint32_t min_chunk_capacity = 2;
+		static const uint32_t max_chunk_capacity = 256;
+
+		// the last chunk of each k-mer
+		std::vector<Chunk *> tails;
+		std::vector<PostingArena> arenas;
+		// set when an experiment was added out of order to a k-mer
+		std::atomic<bool> unsorted{false};
+
+		Chunk * newChunk(KmerIndex index, uint32_t capacity, size_t arena);
+
+	public:
+		IngestPostings(IngestPostings const&) = delete;
+		void operator=(IngestPostings const&) = delete;
+		IngestPostings(KmerIndex n_elem, size_t num_arenas = 1);
+
+		// makes room for n more postings of the k-mer
+		void reserve(KmerIndex index, ExperimentCount n, size_t arena = 0);
+		// adds the count to the posting of the experiment for the k-mer.
+		// Concurrent calls must use different arenas and different k-mers.
+		void add(KmerIndex index, ExperimentId exp_id, KmerCount count, size_t arena = 0);
+		ExperimentCount numExperiments(KmerIndex index) const;
+		size_t numArenas() const { return arenas.size(); }
+
+		// calls f(posting) for all postings of the k-mer, sorted by experiment id
+		template<typename F>
+		void forEach(KmerIndex index, F f) const {
+			const Chunk * tail = tails[index];
+			if(tail == nullptr) return;
+			if(tail->prev == nullptr && !unsorted.load(std::memory_order_relaxed)) {
+				for(uint32_t i = 0; i < tail->size; i++) f(tail->postings()[i]);
+				return;
+			}
+			std::vector<const Chunk *> chunks;
+			for(const Chunk * c = tail; c != nullptr; c = c->prev) {
+				chunks.push_back(c);
+			}
+			if(!unsorted.load(std::memory_order_relaxed)) {
+				for(auto c = chunks.rbegin(); c != chunks.rend(); ++c) {
+					for(uint32_t i = 0; i < (*c)->size; i++) f((*c)->postings()[i]);
+				}
+				return;
+			}
+			std::vector<Posting> postings;
+			for(auto c = chunks.rbegin(); c != chunks.rend(); ++c) {
+				postings.insert(postings.end(), (*c)->postings(), (*c)->postings() + (*c)->size);
+			}
+			std::sort(postings.begin(), postings.end(), [](const Posting & a, const Posting & b) { return a.exp_id < b.exp_id; });
+			for(const Posting & p : postings) f(p);
+		}
+};
@@ -0,0 +1,110 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KIQ_X86
+#endif
+
+#include "KmerEncoder.hpp"
+
+struct EncodeTable {
+	uint8_t code[256];
+	EncodeTable() {
+		memset(code, CODE_INVALID, sizeof(code));
+		code['A'] = code['a'] = DNA_MAP::A;
+		code['C'] = code['c'] = DNA_MAP::C;
+		code['G'] = code['g'] = DNA_MAP::G;
+		code['T'] = code['t'] = DNA_MAP::T;
+	}
+};
+
+static const EncodeTable encode_table;
+
+static void encode_bases_scalar(const char * seq, size_t length, uint8_t * codes) {
+	for(size_t i = 0; i < length; i++) {
+		codes[i] = encode_table.code[static_cast<uint8_t>(seq[i])];
+	}
+}
+
+#ifdef KIQ_X86
+/*
+* The low nibbles of A, C, G and T (1, 3, 7, 4) are distinct and also
+* identify a, c, g and t. The low nibble selects the code and the expected
+* high nibble of the character with bit 0x20 set (lower case) via a byte
+* shuffle, and all characters whose high nibble does not match are flagged.
+*/
+#define ENCODE_TABLES \
+	const char lo_code[16] = { 0, DNA_MAP::A, 0, DNA_MAP::C, DNA_MAP::T, 0, 0, DNA_MAP::G, 0, 0, 0, 0, 0, 0, 0, 0 }; \
+	const char hi_expected[16] = { -1, 6, -1, 6, 7, -1, -1, 6, -1, -1, -1, -1, -1, -1, -1, -1 };
+
+__attribute__((target("sse4.2")))
+static void encode_bases_sse42(const char * seq, size_t length, uint8_t * codes) {
+	ENCODE_TABLES
+	const __m128i code_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo_code));
+	const __m128i hi_table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi_expected));
+	const __m128i mask_lo = _mm_set1_epi8(0x0F);
+	const __m128i lower_case = _mm_set1_epi8(0x20);
+	const __m128i invalid = _mm_set1_epi8(static_cast<char>(CODE_INVALID));
+	size_t i = 0;
+	for(; i + 16 <= length; i += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(seq + i));
+		const __m128i lo = _mm_and_si128(v, mask_lo);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(_mm_or_si128(v, lower_case), 4), mask_lo);
+		const __m128i code = _mm_shuffle_epi8(code_table, lo);
+		const __m128i valid = _mm_cmpeq_epi8(hi, _mm_shuffle_epi8(hi_table, lo));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(codes + i), _mm_blendv_epi8(invalid, code, valid));
+	}
+	encode_bases_scalar(seq + i, length - i, codes + i);
+}
+
+__attribute__((target("avx2")))
+static void encode_bases_avx2(const char * seq, size_t length, uint8_t * codes) {
+	ENCODE_TABLES
+	// _mm256_shuffle_epi8 works within each 128 bit lane, so both lanes get the tables
+	const __m256i code_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lo_code)));
+	const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hi_expected)));
+	const __m256i mask_lo = _mm256_set1_epi8(0x0F);
+	const __m256i lower_case = _mm256_set1_epi8(0x20);
+	const __m256i invalid = _mm256_set1_epi8(static_cast<char>(CODE_INVALID));
+	size_t i = 0;
+	for(; i + 32 <= length; i += 32) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(seq + i));
+		const __m256i lo = _mm256_and_si256(v, mask_lo);
+		const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(_mm256_or_si256(v, lower_case), 4), mask_lo);
+		const __m256i code = _mm256_shuffle_epi8(code_table, lo);
+		const __m256i valid = _mm256_cmpeq_epi8(hi, _mm256_shuffle_epi8(hi_table, lo));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(codes + i), _mm256_blendv_epi8(invalid, code, valid));
+	}
+	encode_bases_scalar(seq + i, length - i, codes + i);
+}
+#endif
+
+typedef void (*encode_function_t)(const char *, size_t, uint8_t *);
+
+struct EncodeKernel {
+	encode_function_t function = encode_bases_scalar;
+	const char * name = "scalar";
+	EncodeKernel() {
+#ifdef KIQ_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) {
+			function = encode_bases_avx2;
+			name = "avx2";
+		}
+		else if(__builtin_cpu_supports("sse4.2")) {
+			function = encode_bases_sse42;
+			name = "sse4.2";
+		}
+#endif
+	}
+};
+
+static const EncodeKernel encode_kernel;
+
+void encode_bases(const char * seq, size_t length, uint8_t * codes) {
+	encode_kernel.function(seq, length, codes);
+}
+
+const char * encode_bases_kernel() {
+	return encode_kernel.name;
+}
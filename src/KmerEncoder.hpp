@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.hpp"
+
+// code for characters other than ACGT/acgt in the output of encode_bases()
+const uint8_t CODE_INVALID = 4;
+
+/**
+* Translates a DNA sequence into 2-bit codes according to DNA_MAP, one code
+* per byte. Lower-case bases are accepted.
+* The AVX2 or SSE4.2 kernel is used if the CPU supports it, which is checked
+* once at runtime, otherwise a table lookup.
+*/
+void encode_bases(const char * seq, size_t length, uint8_t * codes);
+
+// name of the kernel used by encode_bases()
+const char * encode_bases_kernel();
+
+/**
+* Shifts the n codes, which must not be CODE_INVALID, into the k-mer t one by
+* one and writes each resulting k-mer to kmers. A long sequence can be
+* processed in parts by passing the same t again.
+* K is a template parameter, so that the mask is a constant in the loop.
+* KmerT is Kmer for K <= MAX_K_64 and Kmer128 otherwise.
+*/
+template<unsigned K, typename KmerT>
+inline void rolling_kmers(const uint8_t * codes, size_t n, KmerT & t, KmerT * kmers) {
+	const KmerT mask = kmer_mask<KmerT>(K);
+	for(size_t i = 0; i < n; i++) {
+		t = ((t << 2) | codes[i]) & mask;
+		kmers[i] = t;
+	}
+}
+
+/**
+* Like rolling_kmers(), but keeps the reverse complement rc of the k-mer t
+* and writes the canonical k-mers, i.e. the smaller of t and rc.
+*/
+template<unsigned K, typename KmerT>
+inline void rolling_canonical_kmers(const uint8_t * codes, size_t n, KmerT & t, KmerT & rc, KmerT * kmers) {
+	const KmerT mask = kmer_mask<KmerT>(K);
+	for(size_t i = 0; i < n; i++) {
+		t = ((t << 2) | codes[i]) & mask;
+		// the complement of each base in DNA_MAP is code ^ 3
+		rc = (rc >> 2) | (static_cast<KmerT>(codes[i] ^ 3) << (2 * K - 2));
+		kmers[i] = std::min(t, rc);
+	}
+}
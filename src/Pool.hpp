@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+/**
+* A fixed number of objects, which are handed out by get() and returned with
+* put() after use, so that no memory needs to be allocated while processing
+* the input files. Objects are cleared when they are returned.
+*/
+template<typename T>
+class Pool {
+	private:
+		std::vector<T *> objects;
+		std::vector<T *> free_objects;
+		std::mutex pool_mutex;
+		std::condition_variable pool_cv;
+
+	public:
+		Pool(Pool const&) = delete;
+		void operator=(Pool const&) = delete;
+
+		Pool(size_t num_objects) {
+			for(size_t i = 0; i < num_objects; i++) {
+				objects.push_back(new T());
+			}
+			free_objects = objects;
+		}
+
+		~Pool() {
+			for(T * object : objects) {
+				delete object;
+			}
+		}
+
+		size_t size() const { return objects.size(); }
+
+		// blocks until an object is available
+		T * get() {
+			std::unique_lock<std::mutex> pool_lock(pool_mutex);
+			pool_cv.wait(pool_lock, [this]{ return !free_objects.empty(); });
+			T * object = free_objects.back();
+			free_objects.pop_back();
+			return object;
+		}
+
+		void put(T * object) {
+			object->clear();
+			std::unique_lock<std::mutex> pool_lock(pool_mutex);
+			free_objects.push_back(object);
+			pool_lock.unlock();
+			pool_cv.notify_one();
+		}
+};
@@ -0,0 +1,271 @@
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KIQ_X86
+#endif
+
+#include "PostingCodec.hpp"
+
+static_assert(sizeof(ExperimentId) == 4 && sizeof(KmerCount) == 4, "the posting codec encodes 32 bit values");
+
+// the byte length of a value is code + 1
+static unsigned value_code(uint32_t v) {
+	return v < (1U << 8) ? 0 : v < (1U << 16) ? 1 : v < (1U << 24) ? 2 : 3;
+}
+
+static size_t control_size(uint32_t n) {
+	return (static_cast<size_t>(n) + 3) / 4;
+}
+
+static size_t varint_size(uint32_t v) {
+	size_t size = 1;
+	while(v >= 0x80) { v >>= 7; size++; }
+	return size;
+}
+
+static uint8_t * encode_varint(uint32_t v, uint8_t * out) {
+	while(v >= 0x80) {
+		*out++ = static_cast<uint8_t>(v | 0x80);
+		v >>= 7;
+	}
+	*out++ = static_cast<uint8_t>(v);
+	return out;
+}
+
+// returns the position after the varint, or nullptr if it is not within the list or too large
+static const uint8_t * decode_varint(const uint8_t * in, const uint8_t * end, uint32_t & v) {
+	uint64_t value = 0;
+	for(unsigned shift = 0; in < end && shift < 35; shift += 7) {
+		const uint8_t b = *in++;
+		value |= static_cast<uint64_t>(b & 0x7F) << shift;
+		if((b & 0x80) == 0) {
+			if(value > UINT32_MAX) return nullptr;
+			v = static_cast<uint32_t>(value);
+			return in;
+		}
+	}
+	return nullptr;
+}
+
+// writes the control bytes and data bytes of the n values, or of their differences with Delta
+template<bool Delta>
+static uint8_t * encode_values(const uint32_t * values, uint32_t n, uint8_t * out) {
+	uint8_t * ctrl = out;
+	uint8_t * data = out + control_size(n);
+	memset(ctrl, 0, control_size(n));
+	uint32_t prev = 0;
+	for(uint32_t i = 0; i < n; i++) {
+		assert(!Delta || i == 0 || values[i] > prev);
+		const uint32_t v = Delta ? values[i] - prev : values[i];
+		prev = values[i];
+		const unsigned code = value_code(v);
+		ctrl[i >> 2] |= static_cast<uint8_t>(code << (2 * (i & 3)));
+		for(unsigned b = 0; b <= code; b++) {
+			*data++ = static_cast<uint8_t>(v >> (8 * b));
+		}
+	}
+	return data;
+}
+
+size_t encoded_postings_size(const ExperimentId * exp_ids, const KmerCount * counts, ExperimentCount n) {
+	if(n == 0) return 0;
+	size_t size = varint_size(n) + 2 * control_size(n);
+	ExperimentId prev = 0;
+	for(ExperimentCount i = 0; i < n; i++) {
+		size += value_code(exp_ids[i] - prev) + value_code(counts[i]) + 2;
+		prev = exp_ids[i];
+	}
+	return size;
+}
+
+uint8_t * encode_postings(const ExperimentId * exp_ids, const KmerCount * counts, ExperimentCount n, uint8_t * out) {
+	if(n == 0) return out;
+	out = encode_varint(n, out);
+	out = encode_values<true>(exp_ids, n, out);
+	return encode_values<false>(counts, n, out);
+}
+
+/**
+* Decodes the n values from the control bytes at in and the following data
+* bytes, adding up the differences with Delta. Returns the end of the data
+* bytes, or nullptr if they exceed the list.
+*/
+template<bool Delta>
+static inline const uint8_t * decode_values_scalar(const uint8_t * in, const uint8_t * end, uint32_t n, uint32_t * out) {
+	if(static_cast<size_t>(end - in) < control_size(n)) return nullptr;
+	const uint8_t * ctrl = in;
+	const uint8_t * data = in + control_size(n);
+	uint32_t prev = 0;
+	for(uint32_t i = 0; i < n; i++) {
+		const unsigned code = (ctrl[i >> 2] >> (2 * (i & 3))) & 3;
+		if(static_cast<size_t>(end - data) < code + 1) return nullptr;
+		uint32_t v = 0;
+		// little-endian, the bytes beyond the value are masked out
+		memcpy(&v, data, sizeof(v));
+		v &= UINT32_MAX >> (8 * (3 - code));
+		data += code + 1;
+		if(Delta) {
+			prev += v;
+			v = prev;
+		}
+		out[i] = v;
+	}
+	return data;
+}
+
+static bool decode_list_scalar(const uint8_t * in, const uint8_t * end, uint32_t n, ExperimentId * exp_ids, KmerCount * counts) {
+	in = decode_values_scalar<true>(in, end, n, exp_ids);
+	if(in == nullptr) return false;
+	in = decode_values_scalar<false>(in, end, n, counts);
+	// the list must end with the last count
+	return in == end;
+}
+
+#ifdef KIQ_X86
+/*
+* The lengths of four values are given by one control byte, which selects a
+* byte shuffle that moves the bytes of each value to the low bytes of its
+* 32 bit lane and zeroes the others.
+*/
+struct DecodeTable {
+	uint8_t length[256];
+	uint8_t shuffle[256][16];
+	DecodeTable() {
+		for(unsigned c = 0; c < 256; c++) {
+			unsigned pos = 0;
+			for(unsigned lane = 0; lane < 4; lane++) {
+				const unsigned lane_length = ((c >> (2 * lane)) & 3) + 1;
+				for(unsigned b = 0; b < 4; b++) {
+					// indices with the high bit set produce a zero byte
+					shuffle[c][4 * lane + b] = static_cast<uint8_t>(b < lane_length ? pos + b : 0x80);
+				}
+				pos += lane_length;
+			}
+			length[c] = static_cast<uint8_t>(pos);
+		}
+	}
+};
+
+static const DecodeTable decode_table;
+
+// decodes the four values of the control byte c, see decode_values_scalar()
+template<bool Delta>
+__attribute__((target("ssse3")))
+static inline void decode_group_ssse3(uint8_t c, const uint8_t * data, __m128i & prev, uint32_t * out) {
+	const __m128i shuffle = _mm_loadu_si128(reinterpret_cast<const __m128i *>(decode_table.shuffle[c]));
+	// the load may go up to 15 bytes beyond the list into the padding
+	__m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), shuffle);
+	if(Delta) {
+		// prefix sum of the four differences, plus the last value of the previous group
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+		v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+		v = _mm_add_epi32(v, prev);
+		prev = _mm_shuffle_epi32(v, 0xFF);
+	}
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(out), v);
+}
+
+// the control byte of the last group, with code 0 for the unused lanes
+static inline uint8_t last_control(const uint8_t * ctrl, uint32_t n) {
+	return ctrl[n / 4] & (0xFF >> (2 * (4 - n % 4)));
+}
+
+// the sum of the 2-bit codes in x
+__attribute__((target("popcnt")))
+static inline size_t sum_codes(uint64_t x) {
+	return static_cast<size_t>(__builtin_popcountll(x & 0x5555555555555555ULL) + 2 * __builtin_popcountll(x & 0xAAAAAAAAAAAAAAAAULL));
+}
+
+// the size of the data bytes of n values, which is n plus the sum of their codes
+__attribute__((target("popcnt")))
+static inline size_t data_size(const uint8_t * ctrl, uint32_t n) {
+	size_t size = n;
+	const uint32_t full_groups = n / 4;
+	uint32_t g = 0;
+	for(; g + 8 <= full_groups; g += 8) {
+		uint64_t x;
+		memcpy(&x, ctrl + g, sizeof(x));
+		size += sum_codes(x);
+	}
+	for(; g < full_groups; g++) {
+		size += sum_codes(ctrl[g]);
+	}
+	if(n % 4 != 0) size += sum_codes(last_control(ctrl, n));
+	return size;
+}
+
+/*
+* The sizes of both streams are summed up from the control bytes first, which
+* checks the list once and lets the groups of both streams be decoded
+* interleaved, since the start of the counts is known in advance.
+*/
+__attribute__((target("ssse3,popcnt")))
+static bool decode_list_ssse3(const uint8_t * in, const uint8_t * end, uint32_t n, ExperimentId * exp_ids, KmerCount * counts) {
+	const size_t ctrl_size = control_size(n);
+	const uint8_t * const ctrl_ids = in;
+	if(static_cast<size_t>(end - ctrl_ids) < ctrl_size) return false;
+	const uint8_t * data_ids = ctrl_ids + ctrl_size;
+	const size_t size_ids = data_size(ctrl_ids, n);
+	if(static_cast<size_t>(end - data_ids) < size_ids + ctrl_size) return false;
+	const uint8_t * const ctrl_counts = data_ids + size_ids;
+	const uint8_t * data_counts = ctrl_counts + ctrl_size;
+	// the list must end with the last count
+	if(data_size(ctrl_counts, n) != static_cast<size_t>(end - data_counts)) return false;
+
+	__m128i prev = _mm_setzero_si128();
+	__m128i unused;
+	const uint32_t full_groups = n / 4;
+	for(uint32_t g = 0; g < full_groups; g++) {
+		decode_group_ssse3<true>(ctrl_ids[g], data_ids, prev, exp_ids + 4 * g);
+		data_ids += decode_table.length[ctrl_ids[g]];
+		decode_group_ssse3<false>(ctrl_counts[g], data_counts, unused, counts + 4 * g);
+		data_counts += decode_table.length[ctrl_counts[g]];
+	}
+	if(n % 4 != 0) {
+		decode_group_ssse3<true>(last_control(ctrl_ids, n), data_ids, prev, exp_ids + 4 * full_groups);
+		decode_group_ssse3<false>(last_control(ctrl_counts, n), data_counts, unused, counts + 4 * full_groups);
+	}
+	return true;
+}
+#endif
+
+typedef bool (*decode_list_function_t)(const uint8_t *, const uint8_t *, uint32_t, ExperimentId *, KmerCount *);
+
+struct DecodeKernel {
+	decode_list_function_t function = decode_list_scalar;
+	const char * name = "scalar";
+	DecodeKernel() {
+#ifdef KIQ_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+			function = decode_list_ssse3;
+			name = "ssse3";
+		}
+#endif
+	}
+};
+
+static const DecodeKernel decode_kernel;
+
+bool decode_num_postings(const uint8_t * in, size_t size, ExperimentCount & n) {
+	n = 0;
+	if(size == 0) return true;
+	const uint8_t * p = decode_varint(in, in + size, n);
+	// each posting takes at least two data bytes, which bounds the memory for decoding a corrupt list
+	return p != nullptr && n > 0 && 2 * control_size(n) + 2 * static_cast<size_t>(n) <= static_cast<size_t>(in + size - p);
+}
+
+bool decode_postings(const uint8_t * in, size_t size, ExperimentId * exp_ids, KmerCount * counts) {
+	if(size == 0) return true;
+	const uint8_t * const end = in + size;
+	ExperimentCount n = 0;
+	const uint8_t * p = decode_varint(in, end, n);
+	if(p == nullptr || n == 0) return false;
+	return decode_kernel.function(p, end, n, exp_ids, counts);
+}
+
+const char * decode_postings_kernel() {
+	return decode_kernel.name;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.hpp"
+
+/**
+* Compressed posting lists of the database format with DB_FLAG_COMPRESSED.
+* A list starts with the number of postings n as varint, followed by the
+* differences between consecutive experiment ids (the first id itself) and
+* then by the counts. Both sequences are stored like StreamVByte: n 2-bit
+* codes for the byte lengths 1 to 4 of the values, four per control byte,
+* and then the little-endian bytes of the values. An empty list has no bytes.
+*/
+
+// number of bytes written by encode_postings()
+size_t encoded_postings_size(const ExperimentId * exp_ids, const KmerCount * counts, ExperimentCount n);
+
+// encodes the n postings, which must be sorted by experiment id, and returns the end of the written bytes
+uint8_t * encode_postings(const ExperimentId * exp_ids, const KmerCount * counts, ExperimentCount n, uint8_t * out);
+
+// reads the number of postings of the encoded list of size bytes, returns false if the list is corrupt or too short for them
+bool decode_num_postings(const uint8_t * in, size_t size, ExperimentCount & n);
+
+// number of bytes after an encoded list that decode_postings() may read
+const size_t POSTINGS_PADDING = 16;
+
+// room for n postings in the arrays passed to decode_postings(), which decodes groups of four
+inline size_t decode_capacity(ExperimentCount n) {
+	return (static_cast<size_t>(n) + 3) & ~static_cast<size_t>(3);
+}
+
+/**
+* Decodes the encoded list of size bytes into exp_ids and counts, which must
+* have room for decode_capacity(n) values for the number of postings n.
+* Returns false if the list is corrupt.
+* The list must be followed by POSTINGS_PADDING readable bytes, which belong
+* to the next lists or the metadata in the database file.
+* The SSSE3 kernel is used if the CPU supports it, which is checked once at
+* runtime, otherwise a scalar loop.
+*/
+bool decode_postings(const uint8_t * in, size_t size, ExperimentId * exp_ids, KmerCount * counts);
+
+// name of the kernel used by decode_postings()
+const char * decode_postings_kernel();
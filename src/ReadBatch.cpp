@@ -0,0 +1,7 @@
+#include "ReadBatch.hpp"
+
+ReadBatch::ReadBatch(size_t capacity_) : capacity(capacity_) {
+	// reserve some space for the last read that exceeds the capacity
+	buffer.reserve(capacity + (capacity >> 4));
+	offsets.push_back(0);
+}
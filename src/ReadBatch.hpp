@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+#include "Pool.hpp"
+
+class SampleCounts;
+
+/**
+* A batch of reads, whose sequences are stored back to back in a single
+* buffer. The start of each sequence in the buffer is kept in an array of
+* offsets, which has one more element than the number of sequences.
+*/
+class ReadBatch {
+	private:
+		std::vector<char> buffer;
+		std::vector<size_t> offsets;
+		size_t capacity;
+
+	public:
+		// the sample that the reads belong to, set by the producer
+		SampleCounts * sample = nullptr;
+
+		static const size_t default_capacity = 1 << 20;
+		ReadBatch(ReadBatch const&) = delete;
+		void operator=(ReadBatch const&) = delete;
+		ReadBatch(size_t capacity_ = default_capacity);
+
+		void add(const char * seq, size_t length) {
+			buffer.insert(buffer.end(), seq, seq + length);
+			offsets.push_back(buffer.size());
+		}
+		void clear() {
+			buffer.clear();
+			offsets.resize(1);
+			sample = nullptr;
+		}
+		bool full() const { return buffer.size() >= capacity; }
+		bool empty() const { return offsets.size() == 1; }
+		size_t size() const { return offsets.size() - 1; }
+		// all sequences back to back
+		const char * data() const { return buffer.data(); }
+		size_t bytes() const { return buffer.size(); }
+		const char * sequence(size_t i) const { return buffer.data() + offsets[i]; }
+		size_t length(size_t i) const { return offsets[i+1] - offsets[i]; }
+};
+
+// ReadBatches are recycled between the producer and the CountThreads
+using ReadBatchPool = Pool<ReadBatch>;
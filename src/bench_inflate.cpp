@@ -0,0 +1,97 @@
+/*
+	Benchmark comparing the decompression speed of streaming zlib inflate, as
+	used by zstr, with the Inflater backend selected at build time, which
+	decompresses each gzip member in one call.
+
+	Usage: bench_inflate file.gz [repetitions]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <zlib.h>
+
+#include "Inflater.hpp"
+
+// returns the total decompressed size
+size_t run_zlib_stream(const std::vector<char> & input) {
+	std::vector<char> out(1 << 20);
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	if(inflateInit2(&strm, 15 + 16) != Z_OK) throw std::runtime_error("zlib initialization failed");
+	strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+	strm.avail_in = static_cast<uInt>(input.size());
+	size_t total = 0;
+	while(true) {
+		strm.next_out = reinterpret_cast<Bytef *>(out.data());
+		strm.avail_out = static_cast<uInt>(out.size());
+		const int ret = inflate(&strm, Z_NO_FLUSH);
+		total += out.size() - strm.avail_out;
+		if(ret == Z_STREAM_END) {
+			// continue with the next member
+			if(strm.avail_in == 0) break;
+			inflateReset(&strm);
+		}
+		else if(ret != Z_OK) {
+			throw std::runtime_error("corrupt gzip data");
+		}
+	}
+	inflateEnd(&strm);
+	return total;
+}
+
+size_t run_inflater(Inflater & inflater, const std::vector<char> & input, std::vector<char> & out) {
+	size_t in_pos = 0, total = 0;
+	while(in_pos < input.size()) {
+		size_t consumed = 0;
+		total += inflater.inflateGzip(input.data() + in_pos, input.size() - in_pos, out.data() + total, out.size() - total, consumed);
+		in_pos += consumed;
+	}
+	return total;
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		fprintf(stderr, "Usage: bench_inflate file.gz [repetitions]\n");
+		exit(EXIT_FAILURE);
+	}
+	const int repetitions = argc > 2 ? atoi(argv[2]) : 5;
+	std::ifstream ifs(argv[1], std::ios::binary);
+	if(!ifs.good()) { fprintf(stderr, "Could not open file %s\n", argv[1]); exit(EXIT_FAILURE); }
+	std::vector<char> input((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+	try {
+		const size_t total = run_zlib_stream(input);
+		Inflater inflater;
+		std::vector<char> out(total);
+		if(run_inflater(inflater, input, out) != total) throw std::runtime_error("decompressed sizes differ");
+
+		fprintf(stderr, "%lu bytes compressed, %lu bytes decompressed\n", input.size(), total);
+		fprintf(stderr, "%-12s %10s\n", "backend", "MB/s");
+		double best_stream = 0, best_inflater = 0;
+		for(int r = 0; r < repetitions; r++) {
+			auto start = std::chrono::steady_clock::now();
+			run_zlib_stream(input);
+			std::chrono::duration<double> t1 = std::chrono::steady_clock::now() - start;
+			start = std::chrono::steady_clock::now();
+			run_inflater(inflater, input, out);
+			std::chrono::duration<double> t2 = std::chrono::steady_clock::now() - start;
+			best_stream = std::max(best_stream, static_cast<double>(total) / t1.count() / 1e6);
+			best_inflater = std::max(best_inflater, static_cast<double>(total) / t2.count() / 1e6);
+		}
+		fprintf(stderr, "%-12s %10.1f\n", "zstr/zlib", best_stream);
+		fprintf(stderr, "%-12s %10.1f\n", Inflater::backend(), best_inflater);
+	}
+	catch(std::exception & e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		exit(EXIT_FAILURE);
+	}
+	return EXIT_SUCCESS;
+}
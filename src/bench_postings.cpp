@@ -0,0 +1,126 @@
+/*
+	Benchmark comparing the scan of posting lists in the uncompressed layout
+	of the database, i.e. arrays of experiment ids and counts, with decoding
+	the compressed lists of the PostingCodec, for random posting lists. The
+	lists are visited in order, as in kiq dump, and in random order, as in
+	kiq query.
+
+	Usage: bench_postings [num_lists] [mean_list_size] [num_experiments] [repetitions]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <stdexcept>
+
+#include "PostingCodec.hpp"
+
+struct Lists {
+	std::vector<uint64_t> offsets{0};
+	std::vector<ExperimentId> exp_ids;
+	std::vector<KmerCount> counts;
+	std::vector<uint64_t> encoded_offsets{0};
+	std::vector<uint8_t> encoded;
+};
+
+void make_lists(Lists & lists, size_t num_lists, double mean_size, uint32_t num_experiments) {
+	std::mt19937_64 rng(42);
+	std::geometric_distribution<uint32_t> list_size(1.0 / (mean_size + 1));
+	std::geometric_distribution<KmerCount> count(0.2);
+	std::uniform_int_distribution<ExperimentId> exp_id(1, num_experiments);
+	std::set<ExperimentId> ids;
+	for(size_t l = 0; l < num_lists; l++) {
+		const uint32_t n = std::min(list_size(rng), num_experiments);
+		ids.clear();
+		while(ids.size() < n) ids.insert(exp_id(rng));
+		for(ExperimentId id : ids) {
+			lists.exp_ids.push_back(id);
+			lists.counts.push_back(count(rng) + 1);
+		}
+		lists.offsets.push_back(lists.exp_ids.size());
+		const uint64_t from = lists.offsets[l];
+		const size_t size = encoded_postings_size(&lists.exp_ids[from], &lists.counts[from], n);
+		lists.encoded.resize(lists.encoded.size() + size);
+		encode_postings(&lists.exp_ids[from], &lists.counts[from], n, lists.encoded.data() + lists.encoded_offsets[l]);
+		lists.encoded_offsets.push_back(lists.encoded.size());
+	}
+	lists.encoded.resize(lists.encoded.size() + POSTINGS_PADDING);
+}
+
+uint64_t scan_arrays(const Lists & lists, const std::vector<size_t> & order) {
+	uint64_t sum = 0;
+	for(size_t l : order) {
+		for(uint64_t p = lists.offsets[l]; p < lists.offsets[l + 1]; p++) {
+			sum += lists.exp_ids[p] ^ lists.counts[p];
+		}
+	}
+	return sum;
+}
+
+uint64_t scan_encoded(const Lists & lists, const std::vector<size_t> & order, std::vector<ExperimentId> & exp_ids, std::vector<KmerCount> & counts) {
+	uint64_t sum = 0;
+	for(size_t l : order) {
+		const uint8_t * list = lists.encoded.data() + lists.encoded_offsets[l];
+		const size_t size = lists.encoded_offsets[l + 1] - lists.encoded_offsets[l];
+		ExperimentCount n = 0;
+		if(!decode_num_postings(list, size, n) || !decode_postings(list, size, exp_ids.data(), counts.data())) throw std::runtime_error("corrupt posting list");
+		for(ExperimentCount p = 0; p < n; p++) {
+			sum += exp_ids[p] ^ counts[p];
+		}
+	}
+	return sum;
+}
+
+int main(int argc, char** argv) {
+	const size_t num_lists = argc > 1 ? strtoul(argv[1], nullptr, 10) : 2000000;
+	const double mean_size = argc > 2 ? atof(argv[2]) : 20;
+	const uint32_t num_experiments = argc > 3 ? static_cast<uint32_t>(strtoul(argv[3], nullptr, 10)) : 10000;
+	const int repetitions = argc > 4 ? atoi(argv[4]) : 5;
+	if(num_lists == 0 || mean_size <= 0 || num_experiments == 0) {
+		fprintf(stderr, "Usage: bench_postings [num_lists] [mean_list_size] [num_experiments] [repetitions]\n");
+		exit(EXIT_FAILURE);
+	}
+
+	try {
+		Lists lists;
+		make_lists(lists, num_lists, mean_size, num_experiments);
+		const size_t num_postings = lists.exp_ids.size();
+		fprintf(stderr, "%lu lists, %lu postings, %.2f bytes per posting compressed (%s)\n", num_lists, num_postings, static_cast<double>(lists.encoded_offsets.back()) / static_cast<double>(num_postings), decode_postings_kernel());
+
+		std::vector<size_t> in_order(num_lists);
+		for(size_t l = 0; l < num_lists; l++) in_order[l] = l;
+		std::vector<size_t> random_order(in_order);
+		std::shuffle(random_order.begin(), random_order.end(), std::mt19937_64(7));
+		std::vector<ExperimentId> exp_ids(decode_capacity(num_experiments));
+		std::vector<KmerCount> counts(decode_capacity(num_experiments));
+
+		fprintf(stderr, "%-12s %-12s %14s\n", "order", "layout", "Mpostings/s");
+		for(const std::vector<size_t> * order : {&in_order, &random_order}) {
+			double best_arrays = 0, best_encoded = 0;
+			for(int r = 0; r < repetitions; r++) {
+				auto start = std::chrono::steady_clock::now();
+				const uint64_t sum_arrays = scan_arrays(lists, *order);
+				std::chrono::duration<double> t1 = std::chrono::steady_clock::now() - start;
+				start = std::chrono::steady_clock::now();
+				const uint64_t sum_encoded = scan_encoded(lists, *order, exp_ids, counts);
+				std::chrono::duration<double> t2 = std::chrono::steady_clock::now() - start;
+				if(sum_arrays != sum_encoded) throw std::runtime_error("decoded postings differ");
+				best_arrays = std::max(best_arrays, static_cast<double>(num_postings) / t1.count() / 1e6);
+				best_encoded = std::max(best_encoded, static_cast<double>(num_postings) / t2.count() / 1e6);
+			}
+			const char * name = order == &in_order ? "sequential" : "random";
+			fprintf(stderr, "%-12s %-12s %14.1f\n", name, "arrays", best_arrays);
+			fprintf(stderr, "%-12s %-12s %14.1f\n", name, "compressed", best_encoded);
+		}
+	}
+	catch(std::exception & e) {
+		fprintf(stderr, "Error: %s\n", e.what());
+		exit(EXIT_FAILURE);
+	}
+	return EXIT_SUCCESS;
+}
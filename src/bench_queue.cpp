@@ -0,0 +1,95 @@
+/*
+	Microbenchmark comparing the throughput of ProducerConsumerQueue and
+	BoundedRingQueue with one producer and a varying number of consumers,
+	which is the setup used in kiq db and kiq sra.
+
+	Usage: bench_queue [max_consumers] [num_items]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <string>
+#include <algorithm>
+
+#include "ProducerConsumerQueue/ProducerConsumerQueue.hpp"
+#include "ProducerConsumerQueue/BoundedRingQueue.hpp"
+
+const size_t queue_size = 4096;
+const size_t bulk_size = 32;
+
+// simulates some work per item in the consumers
+inline uint64_t work(uint64_t x) {
+	for(int i = 0; i < 20; i++) x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	return x;
+}
+
+template<typename Queue>
+double run_single(size_t num_consumers, size_t num_items) {
+	Queue queue(queue_size);
+	std::atomic<uint64_t> checksum(0);
+	std::deque<std::thread> consumers;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t c = 0; c < num_consumers; c++) {
+		consumers.push_back(std::thread([&]() {
+			uint64_t sum = 0;
+			uintptr_t item;
+			while(queue.pop(item)) sum += work(item);
+			checksum += sum;
+		}));
+	}
+	for(uintptr_t i = 1; i <= num_items; i++) queue.push(i);
+	queue.pushedLast();
+	for(auto & t : consumers) t.join();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return static_cast<double>(num_items) / elapsed.count();
+}
+
+double run_bulk(size_t num_consumers, size_t num_items) {
+	BoundedRingQueue<uintptr_t> queue(queue_size);
+	std::atomic<uint64_t> checksum(0);
+	std::deque<std::thread> consumers;
+	auto start = std::chrono::steady_clock::now();
+	for(size_t c = 0; c < num_consumers; c++) {
+		consumers.push_back(std::thread([&]() {
+			uint64_t sum = 0;
+			uintptr_t items[bulk_size];
+			size_t n;
+			while((n = queue.pop_many(items, bulk_size)) > 0) {
+				for(size_t i = 0; i < n; i++) sum += work(items[i]);
+			}
+			checksum += sum;
+		}));
+	}
+	uintptr_t items[bulk_size];
+	for(uintptr_t i = 1; i <= num_items; i += bulk_size) {
+		size_t n = 0;
+		for(uintptr_t j = i; j < i + bulk_size && j <= num_items; j++) items[n++] = j;
+		queue.push_many(items, n);
+	}
+	queue.pushedLast();
+	for(auto & t : consumers) t.join();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return static_cast<double>(num_items) / elapsed.count();
+}
+
+int main(int argc, char** argv) {
+	size_t max_consumers = std::max(1, argc > 1 ? atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency()));
+	size_t num_items = argc > 2 ? atol(argv[2]) : 2000000;
+
+	printf("consumers\tProducerConsumerQueue\tBoundedRingQueue\tBoundedRingQueue(bulk %lu)\n", bulk_size);
+	// powers of two, ending with max_consumers
+	for(size_t c = 1; ; c = std::min(2 * c, max_consumers)) {
+		double pcq = run_single<ProducerConsumerQueue<uintptr_t>>(c, num_items);
+		double brq = run_single<BoundedRingQueue<uintptr_t>>(c, num_items);
+		double brq_bulk = run_bulk(c, num_items);
+		printf("%lu\t%.0f\t%.0f\t%.0f\n", c, pcq, brq, brq_bulk);
+		if(c >= max_consumers) break;
+	}
+	return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <thread>
+
+#include "BooPHF/BooPHF.h"
+#include "util.hpp"
+#include "IngestPostings.hpp"
+
+
+void usage_kcompact() {
+	print_usage_header();
+	fprintf(stderr, "Usage:\n   kiq compact -i <file> -k <file> [-c | -u] [-b | -B]\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Mandatory arguments:\n");
+	fprintf(stderr, "   -i <file>   Name of index file\n");
+	fprintf(stderr, "   -k <file>   Name of k-mer count database file\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "   -c          Convert the database to compressed counts\n");
+	fprintf(stderr, "   -u          Convert the database to uncompressed counts\n");
+	fprintf(stderr, "   -b          Convert the database to a file compressed in blocks\n");
+	fprintf(stderr, "   -B          Convert the database to a file without blocks\n");
+	fprintf(stderr, "   -v          Enable verbose output\n");
+	fprintf(stderr, "   -d          Enable debug output.\n");
+	exit(EXIT_FAILURE);
+}
+
+template<typename KmerT>
+static int compact_database(const std::string & filename_index, const std::string & filename_db, uint32_t new_flags);
+
+/**
+* Merges the segment log of the database into the database file, and
+* optionally converts the database file to compressed or uncompressed counts
+* and to a file with or without compressed blocks.
+*/
+int main_kcompact(int argc, char** argv) {
+
+	bool debug = false;
+	bool verbose = false;
+	bool compress = false;
+	bool uncompress = false;
+	bool blocks = false;
+	bool no_blocks = false;
+
+	std::string filename_index;
+	std::string filename_db;
+
+	// Read command line params
+	int c;
+	while ((c = getopt(argc, argv, "hdvcubBi:k:")) != -1) {
+		switch (c)  {
+			case 'h':
+				usage_kcompact();
+			case 'd':
+				debug = true; break;
+			case 'v':
+				verbose = true; break;
+			case 'c':
+				compress = true; break;
+			case 'u':
+				uncompress = true; break;
+			case 'b':
+				blocks = true; break;
+			case 'B':
+				no_blocks = true; break;
+			case 'k':
+				filename_db = optarg; break;
+			case 'i':
+				filename_index = optarg; break;
+			default:
+				usage_kcompact();
+		}
+	}
+	if(filename_index.length() == 0) { error("Please specify the name of the index file, using the -i option."); usage_kcompact(); }
+	if(filename_db.length() == 0) { error("Please specify the name of the database file, using the -k option."); usage_kcompact(); }
+
+	if(compress && uncompress) { error("The options -c and -u cannot be used together."); usage_kcompact(); }
+	if(blocks && no_blocks) { error("The options -b and -B cannot be used together."); usage_kcompact(); }
+
+	const uint32_t db_flags = database_flags(filename_db);
+	uint32_t new_flags = compress ? (db_flags | DB_FLAG_COMPRESSED) : uncompress ? (db_flags & ~DB_FLAG_COMPRESSED) : db_flags;
+	new_flags = blocks ? (new_flags | DB_FLAG_BLOCKS) : no_blocks ? (new_flags & ~DB_FLAG_BLOCKS) : new_flags;
+	if(!has_segments(filename_db) && new_flags == db_flags) {
+		std::cerr << getCurrentTime() << " Database " << filename_db << " has no segments to merge\n";
+		return 0;
+	}
+
+	// the k-mers are held in 64 bit up to MAX_K_64 and in 128 bit above
+	if(load_index_header(filename_index).k > MAX_K_64) return compact_database<Kmer128>(filename_index, filename_db, new_flags);
+	return compact_database<Kmer>(filename_index, filename_db, new_flags);
+
+}
+
+template<typename KmerT>
+static int compact_database(const std::string & filename_index, const std::string & filename_db, uint32_t new_flags) {
+
+	boophf<KmerT> * bphf = new boophf<KmerT>();
+	const HeaderIndexFile index_header = load_index(filename_index, bphf);
+
+	KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
+	std::vector<KmerT> initial_kmers;
+	// one arena for each thread that reads a part of the database file
+	IngestPostings kmer2postings(n_elem, std::max(1u, std::thread::hardware_concurrency()));
+	ExpId2Name exp_id2name;
+	ExpId2Desc exp_id2desc;
+	ExpName2Id exp_name2id;
+	ExpId2ReadCount exp_id2readcount;
+
+	try {
+		read_database(filename_db, initial_kmers, kmer2postings, bphf, true, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+	}
+	catch(std::runtime_error e) {
+		std::cerr << "Error while reading database (" << e.what() << ")." << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	write_database(filename_db, initial_kmers, kmer2postings, bphf, exp_id2name, exp_id2desc, exp_id2readcount, index_header.k, new_flags);
+
+	delete bphf;
+
+	return 0;
+
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int main_kcompact(int argc, char** argv);
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <string>
 #include <array>
@@ -15,16 +16,19 @@
 #include <stdexcept>
 #include <memory>
 
-#include "ProducerConsumerQueue/ProducerConsumerQueue.hpp"
-#include "zstr/zstr.hpp"
+#include "ProducerConsumerQueue/BoundedRingQueue.hpp"
 #include "BooPHF/BooPHF.h"
 #include "util.hpp"
-#include "ReadItem.hpp"
-#include "CountThread.hpp"
+#include "IngestPostings.hpp"
+#include "ReadBatch.hpp"
+#include "FastxParser.hpp"
+#include "Decompressor.hpp"
+#include "KmerEncoder.hpp"
+#include "CountEngine.hpp"
 
 void usage_kdb() {
 	print_usage_header();
-	fprintf(stderr, "Usage:\n   kiq db -i <file> -k <file> -l <file> [-a] [-z <int>]\n");
+	fprintf(stderr, "Usage:\n   kiq db -i <file> -k <file> -l <file> [-a] [-s] [-z <int>] [-j <int>] [-m <int>]\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Mandatory arguments:\n");
 	fprintf(stderr, "   -i <file>   Name of index file\n");
@@ -33,19 +37,27 @@ void usage_kdb() {
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Optional arguments:\n");
 	fprintf(stderr, "   -a          Append mode\n");
+	fprintf(stderr, "   -s          Keep the new samples in the segment log of the database\n");
 	fprintf(stderr, "   -z INT      Number of parallel threads for counting (default: 5)\n");
+	fprintf(stderr, "   -j INT      Number of samples that are counted concurrently (default: 1)\n");
+	fprintf(stderr, "   -m INT      Memory limit in MB for thread-local count buffers (default: 2048)\n");
 	fprintf(stderr, "   -v          Enable verbose output\n");
 	fprintf(stderr, "   -d          Enable debug output.\n");
 	exit(EXIT_FAILURE);
 }
 
+template<typename KmerT>
+static int count_samples(size_t max_num_threads, size_t curr_num_threads, size_t num_jobs, size_t max_local_counts_mb, const float ma_alpha, bool append, bool keep_segments, bool verbose, const std::string & filename_index, const std::string & filename_db, const std::string & filename_inputlist);
+
 int main_kdb(int argc, char** argv) {
 
 	size_t max_num_threads = 5;
 	size_t curr_num_threads = 5;
-	size_t max_queue_size = 9999;
+	size_t num_jobs = 1;
+	size_t max_local_counts_mb = 2048;
 	const float ma_alpha = 0.7f;
 	bool append = false;
+	bool keep_segments = false;
 	bool debug = false;
 	bool verbose = false;
 
@@ -55,7 +67,7 @@ int main_kdb(int argc, char** argv) {
 
 	// Read command line params
 	int c;
-	while ((c = getopt(argc, argv, "hdvai:k:l:z:")) != -1) {
+	while ((c = getopt(argc, argv, "hdvasi:k:l:z:j:m:")) != -1) {
 		switch (c)  {
 			case 'h':
 				usage_kdb();
@@ -65,6 +77,8 @@ int main_kdb(int argc, char** argv) {
 				verbose = true; break;
 			case 'a':
 				append = true; break;
+			case 's':
+				keep_segments = true; break;
 			case 'k':
 				filename_db = optarg; break;
 			case 'i':
@@ -75,6 +89,10 @@ int main_kdb(int argc, char** argv) {
 				max_num_threads = atoi(optarg);
 				curr_num_threads = max_num_threads;
 				break;
+			case 'j':
+				num_jobs = atoi(optarg); break;
+			case 'm':
+				max_local_counts_mb = atoi(optarg); break;
 			default:
 				usage_kdb();
 		}
@@ -82,34 +100,83 @@ int main_kdb(int argc, char** argv) {
 	if(filename_index.length() == 0) { error("Please specify the name of the index file, using the -i option."); usage_kdb(); }
 	if(filename_db.length() == 0) { error("Please specify the name of the database file, using the -k option."); usage_kdb(); }
 	if(filename_inputlist.length() == 0) { error("Please specify the name of the sample list file, using the -l option."); usage_kdb(); }
+	if(curr_num_threads == 0) { error("The number of threads must be at least 1."); usage_kdb(); }
+	if(num_jobs == 0) { error("The number of concurrent samples must be at least 1."); usage_kdb(); }
+
+	// the k-mers are held in 64 bit up to MAX_K_64 and in 128 bit above
+	const unsigned k = load_index_header(filename_index).k;
+	if(k > MAX_K_64) return count_samples<Kmer128>(max_num_threads, curr_num_threads, num_jobs, max_local_counts_mb, ma_alpha, append, keep_segments, verbose, filename_index, filename_db, filename_inputlist);
+	return count_samples<Kmer>(max_num_threads, curr_num_threads, num_jobs, max_local_counts_mb, ma_alpha, append, keep_segments, verbose, filename_index, filename_db, filename_inputlist);
+
+}
+
+/**
+* Counts the k-mers of all samples in the sample list and adds them to the
+* database, using k-mers of type KmerT.
+*/
+template<typename KmerT>
+static int count_samples(size_t max_num_threads, size_t curr_num_threads, size_t num_jobs, size_t max_local_counts_mb, const float ma_alpha, bool append, bool keep_segments, bool verbose, const std::string & filename_index, const std::string & filename_db, const std::string & filename_inputlist) {
 
-	boophf_t * bphf = new boomphf::mphf<u_int64_t,hasher_t>();
-	load_index(filename_index, bphf);
+	boophf<KmerT> * bphf = new boophf<KmerT>();
+	const HeaderIndexFile index_header = load_index(filename_index, bphf);
+	const bool canonical = index_header.flags & INDEX_FLAG_CANONICAL;
 
 	KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
-	std::vector<Kmer> initial_kmers;
-	pCountMap * kmer2countmap = new pCountMap[n_elem](); // init new array of size n_elem
+	std::vector<KmerT> initial_kmers;
+	// one arena for each thread that adds the counts of a sample
+	IngestPostings kmer2postings(n_elem, curr_num_threads);
 	ExpId2Name exp_id2name;
 	ExpId2Desc exp_id2desc;
 	ExpName2Id exp_name2id;
 	ExpId2ReadCount exp_id2readcount;
 
 	try {
-		read_database(filename_db, initial_kmers, kmer2countmap, bphf, append, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+		read_database(filename_db, initial_kmers, kmer2postings, bphf, append, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
 	}
 	catch(std::runtime_error e) {
 		std::cerr << "Error while reading database (" << e.what() << ")." << std::endl;
 		exit(EXIT_FAILURE);
 	}
-
-	std::unordered_set<Kmer> initial_kmers_set;
-	initial_kmers_set.insert(initial_kmers.cbegin(),initial_kmers.cend());
-
-	std::atomic<KmerCount> * tmp_counts_atomic = new std::atomic<KmerCount>[n_elem];
+	// the database is written again in the same format
+	const uint32_t db_flags = database_flags(filename_db);
+
+	repair_segment_log(filename_db);
+
+	// k-mers laid out in MPHF index order, for verifying hits in the CountThreads
+	std::vector<KmerT> index2kmer;
+	fill_index2kmer(initial_kmers, bphf, index2kmer);
+
+	// each CountThread accumulates into its own count array for each sample in
+	// flight if these fit into the memory limit, otherwise all threads
+	// increment the shared atomic counts of the samples
+	const bool use_local_counts = n_elem * sizeof(KmerCount) * curr_num_threads * num_jobs <= max_local_counts_mb * 1024 * 1024;
+	if(verbose && !use_local_counts) std::cerr << "Thread-local count buffers exceed memory limit, using shared counts.\n";
+	if(verbose) std::cerr << "Using " << encode_bases_kernel() << " kernel for encoding bases.\n";
+
+	// the CountThreads and their buffers are kept for all samples, reads are
+	// passed to them in batches, which are recycled via the pool of the engine
+	CountEngine<KmerT> engine(curr_num_threads, num_jobs, bphf, index2kmer.data(), use_local_counts, index_header.k, canonical);
+	SampleScheduler<KmerT> scheduler(engine);
+
+	// BGZF input is decompressed by one thread per CountThread, which need more
+	// chunks in flight, and the threads are divided among concurrent samples
+	const size_t decompress_threads = std::max<size_t>(1, curr_num_threads / num_jobs);
+	std::vector<std::unique_ptr<RawChunkPool>> chunk_pools;
+	for(size_t i = 0; i < num_jobs; i++) {
+		chunk_pools.emplace_back(new RawChunkPool(2 * decompress_threads + 4));
+	}
 
 	std::ifstream ifs_inputlist(filename_inputlist);
 	if(!ifs_inputlist) { std::cerr << "Cannot open file " << filename_inputlist << std::endl; exit(EXIT_FAILURE); }
 
+	// names of the samples in the list, for skipping repeated samples in append mode
+	std::set<std::string> listed_names;
+
+	// the counts of each sample are appended as a segment to the segment log,
+	// except without append mode, where the first sample replaces all counts
+	// in the database file
+	bool write_first_sample = !append;
+
 	std::string line;
 	while(getline(ifs_inputlist, line)) {
 		if(line.length() == 0) { continue; }
@@ -129,149 +196,182 @@ int main_kdb(int argc, char** argv) {
 			experiment_desc = line.substr(tab2+1);
 		}
 
-		ExperimentId experiment_numericid = 0;
-
-		if(exp_name2id.count(experiment_stringid) > 0) {
-			if(append) {
-				std::cerr << "Experiment " << experiment_stringid << " is already in database. Skipping...\n" ;
-				continue; // don't do that experiment again in append mode
-			}
-			experiment_numericid = exp_name2id.at(experiment_stringid);
-		} else {
-			experiment_numericid = get_next_experiment_id(exp_id2name);
-			exp_id2name.emplace(experiment_numericid,experiment_stringid);
-			exp_name2id.emplace(experiment_stringid,experiment_numericid);
-			exp_id2desc.emplace(experiment_numericid,experiment_desc);
+		if(append && (exp_name2id.count(experiment_stringid) > 0 || listed_names.count(experiment_stringid) > 0)) {
+			std::cerr << "Experiment " << experiment_stringid << " is already in database. Skipping...\n" ;
+			continue; // don't do that experiment again in append mode
 		}
+		listed_names.insert(experiment_stringid);
 
-		memset(tmp_counts_atomic,0,n_elem*sizeof(std::atomic<KmerCount>));
+		// counts the sample, possibly while other samples are counted in other threads
+		auto count_sample = [&, filename_seq](SampleCounts & sample) {
+			RawChunkPool & chunk_pool = *chunk_pools[sample.slot];
 
-		auto queue = new queue_t(max_queue_size);
-		std::deque<std::thread> threads;
-		std::deque<std::unique_ptr<CountThread>> threadpointers;
-		for(int i=0; i < static_cast<int>(curr_num_threads); i++) {
-			std::unique_ptr<CountThread> p(new CountThread(queue,tmp_counts_atomic,bphf,&initial_kmers_set));
-			threads.push_back(std::thread(&CountThread::doWork,p.get()));
-			threadpointers.push_back(std::move(p));
-		}
+			// uncompressed files are split into one byte range per CountThread, which
+			// parses and counts its range directly without going through the queue,
+			// unless the threads are shared with other samples
+			uint64_t file_size = 0;
+			bool is_fastq = false;
+			bool split_file = is_plain_fastx(filename_seq, file_size, is_fastq) && num_jobs == 1;
+
+			size_t count=0;
+
+			std::cerr << getCurrentTime() << " Start counting k-mers from file "<< filename_seq <<  "\n";
 
-		std::ifstream ifstr(filename_seq);
-		if(!ifstr.good()) {  error("Could not open file " + filename_seq); exit(EXIT_FAILURE); }
-		zstr::istream in1_file(ifstr);
-		if(!in1_file.good()) {  error("Could not open file " + filename_seq); exit(EXIT_FAILURE); }
-
-		bool firstline_file1 = true;
-		bool isFastQ_file1 = false;
-		std::string line_from_file;
-		line_from_file.reserve(2000);
-		std::string sequence1;
-		sequence1.reserve(2000);
-
-		/* vars for progress indicator */
-		unsigned char x[4] = { '/','-','\\','|'};
-		size_t count=0;
-		float ma = 1; // running average of queue size
-		int i = 0;
-
-		std::cerr << getCurrentTime() << " Start counting k-mers from file "<< filename_seq <<  "\n";
-
-		while(getline(in1_file,line_from_file)) {
-			if(line_from_file.length() == 0) { continue; }
-			if(firstline_file1) {
-				char fileTypeIdentifier = line_from_file[0];
-				if(fileTypeIdentifier == '@') {
-					isFastQ_file1 = true;
+			// times that each stage of the pipeline spent waiting for the others
+			double decompress_stall = 0, parser_stall_input = 0;
+			StallTimer parser_stall;
+			const double count_stall_start = engine.stallSeconds();
+
+			if(split_file) {
+				const bool ranges_ok = engine.countFileRanges(sample, filename_seq, file_size, is_fastq);
+				if(!engine.errorMessage().empty()) {
+					throw std::runtime_error(engine.errorMessage() + " for file " + filename_seq);
 				}
-				else if(fileTypeIdentifier != '>') {
-					error("Auto-detection of file type for file " + filename_seq + " failed.");
-					exit(EXIT_FAILURE);
+				if(ranges_ok) {
+					count = engine.numReads();
+				}
+				else {
+					std::cerr << "Warning: Splitting file " << filename_seq << " at record boundaries failed, reading it sequentially.\n";
+					split_file = false;
+					engine.clearCounts(sample);
 				}
-				firstline_file1 = false;
-			}
-			if(isFastQ_file1) {
-				// read sequence line
-				getline(in1_file,line_from_file);
-				sequence1 = line_from_file;
-				// skip + lin
-				in1_file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-				// skip quality score line
-				in1_file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
 			}
-			else { //FASTA
-				// read lines until next entry starts or file terminates
-				sequence1.clear();
-				while(!(in1_file.peek()=='>' || in1_file.peek()==EOF)) {
-					getline(in1_file,line_from_file);
-					sequence1.append(line_from_file);
+
+			if(!split_file) {
+				// decompression, parsing and counting run in separate threads
+				engine.startQueue();
+				ReadBatchPool & batch_pool = engine.batches();
+				std::unique_ptr<Decompressor> decompressor(Decompressor::open(filename_seq, chunk_pool, decompress_threads));
+				ChunkQueueSource source(decompressor->chunks(), chunk_pool);
+				FastxParser parser(source);
+				const char * sequence1 = nullptr;
+				size_t sequence1_length = 0;
+
+				/* vars for progress indicator, which is only shown for one sample at a time */
+				const bool progress = num_jobs == 1;
+				unsigned char x[4] = { '/','-','\\','|'};
+				float ma = 1; // running average of queue size
+				int i = 0;
+
+				ReadBatch * batch = batch_pool.get();
+
+				try {
+					while(parser.next(sequence1, sequence1_length)) {
+						if(sequence1_length >= index_header.k) {
+							batch->add(sequence1, sequence1_length);
+							if(batch->full()) {
+								parser_stall.start();
+								engine.push(sample, batch);
+								batch = batch_pool.get();
+								parser_stall.stop();
+							}
+						}
+						if(count++ % 100000 == 0 && progress) {
+							size_t curr_queue_size = engine.queueSize();
+							ma = ma * (1-ma_alpha) + static_cast<float>(curr_queue_size) * ma_alpha;
+							fprintf(stderr,"\r%c %lu/%lu %4i ", x[i++], curr_num_threads, max_num_threads, static_cast<int>(ma));
+							if(i>3) i=0;
+						}
+					} // end main loop around file1
+				}
+				catch(std::runtime_error & e) {
+					// the decompressor and the batches that were already pushed must
+					// finish before the sample is given up
+					batch_pool.put(batch);
+					source.discard();
+					decompressor->join();
+					sample.waitDone();
+					throw std::runtime_error(std::string(e.what()) + " for file " + filename_seq);
+				}
+				if(!batch->empty()) engine.push(sample, batch);
+				else batch_pool.put(batch);
+				if(progress) {
+					fprintf(stderr,"\r                              \r");
+					fflush(stderr);
 				}
-			} // end FASTA
 
-			strip(sequence1); // remove non-alphabet chars
-			if(sequence1.length() >= KMER_K) {
-				queue->push(new ReadItem(sequence1));
-			}
-			if(count++ % 100000 == 0) {
-				size_t curr_queue_size = queue->size();
-				ma = ma * (1-ma_alpha) + static_cast<float>(curr_queue_size) * ma_alpha;
-				fprintf(stderr,"\r%c %lu/%lu %4i ", x[i++], curr_num_threads, max_num_threads, static_cast<int>(ma));
-				if(i>3) i=0;
+				decompressor->join();
+				if(!decompressor->errorMessage().empty()) {
+					sample.waitDone();
+					throw std::runtime_error("Could not read file " + filename_seq + " (" + decompressor->errorMessage() + ")");
+				}
+				decompress_stall = decompressor->stallSeconds();
+				parser_stall_input = source.stallSeconds();
 			}
-		} // end main loop around file1
-		fprintf(stderr,"\r                              \r");
-		fflush(stderr);
-
-		// finish reading file
 
-		queue->pushedLast();
-		while(!threads.empty()) {
-			threads.front().join();
-			threads.pop_front();
-			threadpointers.pop_front();
-		}
-		delete queue;
+			if(verbose && !split_file) {
+				fprintf(stderr, "%s Waiting times: decompression %.2fs, parsing %.2fs (input) + %.2fs (output), counting %.2fs per thread\n", getCurrentTime().c_str(), decompress_stall, parser_stall_input, parser_stall.seconds(), (engine.stallSeconds() - count_stall_start) / static_cast<double>(curr_num_threads));
+			}
+			sample.num_reads = count;
+		};
+
+		// adds the counts to the database, in the order of the input list
+		auto commit_sample = [&, experiment_stringid, experiment_desc](SampleCounts & sample) {
+			ExperimentId experiment_numericid = 0;
+			if(exp_name2id.count(experiment_stringid) > 0) {
+				experiment_numericid = exp_name2id.at(experiment_stringid);
+			} else {
+				experiment_numericid = get_next_experiment_id(exp_id2name);
+				exp_id2name.emplace(experiment_numericid,experiment_stringid);
+				exp_name2id.emplace(experiment_stringid,experiment_numericid);
+				exp_id2desc.emplace(experiment_numericid,experiment_desc);
+			}
 
-		std::cerr << getCurrentTime() << " Processed " << count << " sequences\n";
+			std::cerr << getCurrentTime() << " Processed " << sample.num_reads << " sequences\n";
 
-		if(exp_id2readcount.count(experiment_numericid) > 0) {
-			exp_id2readcount.at(experiment_numericid) =  exp_id2readcount.at(experiment_numericid) + count;
-		}
-		else {
-			exp_id2readcount.emplace(experiment_numericid,count);
-		}
+			if(exp_id2readcount.count(experiment_numericid) > 0) {
+				exp_id2readcount.at(experiment_numericid) =  exp_id2readcount.at(experiment_numericid) + sample.num_reads;
+			}
+			else {
+				exp_id2readcount.emplace(experiment_numericid,sample.num_reads);
+			}
 
-		//then finally go through all k-mers and add to big hash map
-		for(KmerIndex i=0; i < n_elem; i++) {
-			if(tmp_counts_atomic[i]==0) {
-				continue;
+			//then finally go through all counted k-mers and add to the postings,
+			//each thread adding a separate range of k-mers, so that no locking is needed
+			std::vector<SegmentEntries> part_entries(curr_num_threads);
+			// the counts are cleared for the next sample while taking them
+			sample.takeCounts(curr_num_threads, [&](size_t part, KmerIndex i, KmerCount c) {
+				part_entries[part].emplace_back(i, c);
+				kmer2postings.add(i, experiment_numericid, c, part);
+			});
+			SegmentEntries entries;
+			for(auto & p : part_entries) {
+				entries.insert(entries.end(), p.begin(), p.end());
 			}
-			if(kmer2countmap[i]==nullptr) { // experiment id has not been seen for this k-mer before
-				kmer2countmap[i] = new CountMap();
-				kmer2countmap[i]->emplace(experiment_numericid, tmp_counts_atomic[i]);
+
+			// save database to file
+			if(write_first_sample) {
+				write_database(filename_db, initial_kmers, kmer2postings, bphf, exp_id2name, exp_id2desc, exp_id2readcount, index_header.k, db_flags);
+				write_first_sample = false;
 			}
 			else {
-				auto pos = kmer2countmap[i]->find(experiment_numericid);
-				if(pos != kmer2countmap[i]->end()) {
-					pos->second += tmp_counts_atomic[i];
-				}
-				else {
-					kmer2countmap[i]->emplace(experiment_numericid, tmp_counts_atomic[i]);
-				}
+				append_segment(filename_db, experiment_numericid, experiment_stringid, experiment_desc, sample.num_reads, entries);
 			}
-		}
+		};
 
-		// save database to file
-		write_database(filename_db, initial_kmers, kmer2countmap, bphf, exp_id2name, exp_id2desc, exp_id2readcount);
+		try {
+			scheduler.add(count_sample, commit_sample);
+		}
+		catch(std::exception & e) {
+			error(std::string(e.what()) + ".");
+			exit(EXIT_FAILURE);
+		}
 
 	} // end while list of all experiments to read from files
 
+	try {
+		scheduler.finish();
+	}
+	catch(std::exception & e) {
+		error(std::string(e.what()) + ".");
+		exit(EXIT_FAILURE);
+	}
 
-	delete[] tmp_counts_atomic;
-	for(KmerIndex i = 0; i < n_elem;i++) {
-		if(kmer2countmap[i] != nullptr) {
-			delete kmer2countmap[i];
-		}
+	// the segments are merged into the database file once at the end
+	if(!keep_segments && has_segments(filename_db)) {
+		write_database(filename_db, initial_kmers, kmer2postings, bphf, exp_id2name, exp_id2desc, exp_id2readcount, index_header.k, db_flags);
 	}
-	delete[] kmer2countmap;
+
 	delete bphf;
 
 	return 0;
@@ -12,10 +12,12 @@
 #include <string>
 #include <atomic>
 #include <deque>
+#include <memory>
 #include <stdexcept>
 
 #include "BooPHF/BooPHF.h"
 #include "util.hpp"
+#include "DatabaseView.hpp"
 
 
 void usage_kdump() {
@@ -33,6 +35,9 @@ void usage_kdump() {
 	exit(EXIT_FAILURE);
 }
 
+template<typename KmerT>
+static int dump_database(const std::string & filename_index, const std::string & filename_db, const std::string & mode);
+
 int main_kdump(int argc, char** argv) {
 
 	bool debug = false;
@@ -66,55 +71,64 @@ int main_kdump(int argc, char** argv) {
 	if(filename_db.length() == 0) { error("Please specify the name of the database file, using the -k option."); usage_kdump(); }
 	if(mode.length()==0) { error("Specify mode with option -p."); usage_kdump(); }
 
-	boophf_t * bphf = new boomphf::mphf<u_int64_t,hasher_t>();
-	load_index(filename_index, bphf);
+	// the k-mers are held in 64 bit up to MAX_K_64 and in 128 bit above
+	if(load_index_header(filename_index).k > MAX_K_64) return dump_database<Kmer128>(filename_index, filename_db, mode);
+	return dump_database<Kmer>(filename_index, filename_db, mode);
+
+}
+
+template<typename KmerT>
+static int dump_database(const std::string & filename_index, const std::string & filename_db, const std::string & mode) {
+
+	boophf<KmerT> * bphf = new boophf<KmerT>();
+	const HeaderIndexFile index_header = load_index(filename_index, bphf);
 
 	KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
-	std::vector<Kmer> initial_kmers;
-	pCountMap * kmer2countmap = new pCountMap[n_elem](); // init new array of size n_elem
 	ExpId2Name exp_id2name;
 	ExpId2Desc exp_id2desc;
 	ExpName2Id exp_name2id;
 	ExpId2ReadCount exp_id2readcount;
 
+	std::unique_ptr<DatabaseView<KmerT>> db;
 	try {
-		read_database(filename_db, initial_kmers, kmer2countmap, bphf, true, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+		db.reset(new DatabaseView<KmerT>(filename_db, bphf, true, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount));
 	}
 	catch(std::runtime_error e) {
 		std::cerr << "Error while reading database (" << e.what() << ")." << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
+	typename DatabaseView<KmerT>::PostingBuffer buffer;
 	if(mode=="db") {
-		for(auto it : initial_kmers) {
+		for(uint64_t n = 0; n < db->num_kmers; n++) {
+			const KmerT it = db->kmers[n];
 			KmerIndex i = bphf->lookup(it);
 			assert(i < n_elem);
 
 			// print k-mer index
-			std::cout << int_to_str(it) << "\t";
+			std::cout << int_to_str(it, index_header.k) << "\t";
 			// print number of experiments having this k-mer
-			uint32_t num_exp = kmer2countmap[i]==nullptr ? 0 : (uint32_t)(kmer2countmap[i]->size());
-			std::cout << num_exp;
-			if(num_exp > 0) {
-				for(auto const & it : *kmer2countmap[i]) {
-					assert(exp_id2name.find(it.first) != exp_id2name.end());
-					std::cout << "\tname=" << exp_id2name.at(it.first) << " count=" << it.second;
-				}
+			const typename DatabaseView<KmerT>::PostingList postings = db->postingList(i, buffer);
+			std::cout << postings.size;
+			for(ExperimentCount p = 0; p < postings.size; p++) {
+				assert(exp_id2name.find(postings.exp_ids[p]) != exp_id2name.end());
+				std::cout << "\tname=" << exp_id2name.at(postings.exp_ids[p]) << " count=" << postings.counts[p];
 			}
 			std::cout << "\n";
 		}
 	}
 	else if(mode=="long") {
-		for(auto it : initial_kmers) {
+		for(uint64_t n = 0; n < db->num_kmers; n++) {
+			const KmerT it = db->kmers[n];
 			KmerIndex i = bphf->lookup(it);
 			assert(i < n_elem);
-			uint32_t num_exp = kmer2countmap[i]==nullptr ? 0 : (uint32_t)(kmer2countmap[i]->size());
-			if(num_exp > 0) {
-				std::string kmer = int_to_str(it) ;
-				for(auto const & it : *kmer2countmap[i]) {
-					double rpm = (double)it.second / (double)exp_id2readcount.at(it.first) * 1e6;
-					std::string exp_name = exp_id2name.at(it.first);
-					std::cout << kmer << "\t" << exp_name << "\t" << it.second << "\t" << rpm << "\n";
+			const typename DatabaseView<KmerT>::PostingList postings = db->postingList(i, buffer);
+			if(postings.size > 0) {
+				std::string kmer = int_to_str(it, index_header.k) ;
+				for(ExperimentCount p = 0; p < postings.size; p++) {
+					double rpm = (double)postings.counts[p] / (double)exp_id2readcount.at(postings.exp_ids[p]) * 1e6;
+					std::string exp_name = exp_id2name.at(postings.exp_ids[p]);
+					std::cout << kmer << "\t" << exp_name << "\t" << postings.counts[p] << "\t" << rpm << "\n";
 				}
 			}
 		}
@@ -137,11 +151,12 @@ int main_kdump(int argc, char** argv) {
 		std::cout << "Number of k-mers\t" << n_elem <<"\n";
 		// count number of k-mers with at least one experiment
 		int count = 0;
-		for(auto it : initial_kmers) {
+		for(uint64_t n = 0; n < db->num_kmers; n++) {
+			const KmerT it = db->kmers[n];
 			KmerIndex i = bphf->lookup(it);
 			assert(i < n_elem);
 			// print k-mer index
-			uint32_t num_exp = kmer2countmap[i]==nullptr ? 0 : (uint32_t)(kmer2countmap[i]->size());
+			uint32_t num_exp = db->numExperiments(i);
 			if(num_exp > 0) {
 				count++;
 			}
@@ -149,13 +164,6 @@ int main_kdump(int argc, char** argv) {
 		std::cout << "K-mers with experiments\t" << count << "\n";
 	}
 
-
-	for(KmerIndex i = 0; i < n_elem;i++) {
-		if(kmer2countmap[i] != nullptr) {
-			delete kmer2countmap[i];
-		}
-	}
-	delete[] kmer2countmap;
 	delete bphf;
 
 	return 0;
@@ -23,11 +23,17 @@ void usage_kindex() {
 	fprintf(stderr, "   -l <file>   Name of file containing k-mers to be indexed\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Optional arguments:\n");
+	fprintf(stderr, "   -C          Index canonical k-mers for counting both strands\n");
+	fprintf(stderr, "   -c          Store the counts in the database in compressed form\n");
+	fprintf(stderr, "   -b          Compress the database file in blocks\n");
 	fprintf(stderr, "   -v          Enable verbose output\n");
 	fprintf(stderr, "   -d          Enable debug output.\n");
 	exit(EXIT_FAILURE);
 }
 
+template<typename KmerT>
+static void index_kmers(std::ifstream & filestream_kmers, std::string & line_from_file, unsigned k, bool canonical, const std::string & filename_db, const std::string & filename_index, uint32_t db_flags);
+
 int main_kindex(int argc, char** argv) {
 
 
@@ -36,10 +42,13 @@ int main_kindex(int argc, char** argv) {
 	std::string filename_index;
 	bool debug = false;
 	bool verbose = false;
+	bool canonical = false;
+	bool compressed = false;
+	bool blocks = false;
 
 	// Read command line params
 	int c;
-	while ((c = getopt(argc, argv, "hdvai:k:l:z:")) != -1) {
+	while ((c = getopt(argc, argv, "hdvaCcbi:k:l:z:")) != -1) {
 		switch (c)  {
 			case 'h':
 				usage_kindex();
@@ -47,6 +56,12 @@ int main_kindex(int argc, char** argv) {
 				debug = true; break;
 			case 'v':
 				verbose = true; break;
+			case 'C':
+				canonical = true; break;
+			case 'c':
+				compressed = true; break;
+			case 'b':
+				blocks = true; break;
 			case 'k':
 				filename_db = optarg; break;
 			case 'i':
@@ -67,41 +82,69 @@ int main_kindex(int argc, char** argv) {
 
 	std::cerr << getCurrentTime() << " Start reading k-mers from file " << filename_kmers << "\n";
 	std::string line_from_file;
-	line_from_file.reserve(KMER_K+1);
+	line_from_file.reserve(MAX_K+1);
 
-	// first read all lines into a set, to remove duplicates
-	std::set<Kmer> input_kmers_set;
+	// the length of the first k-mer determines k for the index
+	unsigned k = 0;
 	while(getline(filestream_kmers,line_from_file)) {
 		if(line_from_file.length() == 0) { continue; }
-		if(line_from_file.length() < KMER_K){ std::cerr << "Warning: Line too short: " << line_from_file << "\n"; continue; }
-		if(line_from_file.length() > KMER_K){ std::cerr << "Warning: Line too long: " << line_from_file << "\n"; continue; }
-		Kmer kmer = str_to_int(line_from_file);
+		if(line_from_file.length() > MAX_K) { error("The k-mers must not be longer than " + std::to_string(MAX_K) + ", found: " + line_from_file); exit(EXIT_FAILURE); }
+		k = static_cast<unsigned>(line_from_file.length());
+		std::cerr << getCurrentTime() << " Using k=" << k << "\n";
+		break;
+	}
+
+	uint32_t db_flags = 0;
+	if(compressed) db_flags |= DB_FLAG_COMPRESSED;
+	if(blocks) db_flags |= DB_FLAG_BLOCKS;
+
+	// the k-mers are held in 64 bit up to MAX_K_64 and in 128 bit above
+	if(k > MAX_K_64) index_kmers<Kmer128>(filestream_kmers, line_from_file, k, canonical, filename_db, filename_index, db_flags);
+	else index_kmers<Kmer>(filestream_kmers, line_from_file, k, canonical, filename_db, filename_index, db_flags);
+
+	return 0;
+
+}
+
+/**
+* Reads the k-mers of length k, starting with the first k-mer in
+* line_from_file, and writes the index and the initial database.
+*/
+template<typename KmerT>
+static void index_kmers(std::ifstream & filestream_kmers, std::string & line_from_file, unsigned k, bool canonical, const std::string & filename_db, const std::string & filename_index, uint32_t db_flags) {
+
+	// first read all lines into a set, to remove duplicates
+	std::set<KmerT> input_kmers_set;
+	for(bool first = k > 0; first || getline(filestream_kmers,line_from_file); first = false) {
+		if(line_from_file.length() == 0) { continue; }
+		if(line_from_file.length() < k){ std::cerr << "Warning: Line too short: " << line_from_file << "\n"; continue; }
+		if(line_from_file.length() > k){ std::cerr << "Warning: Line too long: " << line_from_file << "\n"; continue; }
+		if(!is_dna(line_from_file)){ std::cerr << "Warning: Line contains characters other than ACGT: " << line_from_file << "\n"; continue; }
+		KmerT kmer = str_to_int<KmerT>(line_from_file);
+		// a k-mer and its reverse complement become the same entry
+		if(canonical) kmer = canonical_kmer(kmer, k);
 		input_kmers_set.emplace(kmer);
 	}
 	filestream_kmers.close();
 
 	// copy k-mers from set into vector
-	std::vector<Kmer> initial_kmers;
+	std::vector<KmerT> initial_kmers;
 	initial_kmers.insert(initial_kmers.end(), input_kmers_set.cbegin(), input_kmers_set.cend());
 
 	// sort k-mers, so that they will be saved in proper order
 	std::sort(initial_kmers.begin(), initial_kmers.end());
 
 	std::cerr << getCurrentTime() << " Calculating hash functions for " << initial_kmers.size() << " k-mers\n";
-	boophf_t * bphf = new boomphf::mphf<u_int64_t,hasher_t>(initial_kmers.size(),initial_kmers,1);
-
-	write_initial_database(filename_db, initial_kmers);
+	boophf<KmerT> * bphf = new boophf<KmerT>(initial_kmers.size(),initial_kmers,1);
 
-	std::cerr << getCurrentTime() << " Writing index to file " << filename_index << "\n";
-	std::ofstream os(filename_index, std::ofstream::out);
-	if(!os.is_open()) { error("Could not open file " + filename_index); exit(EXIT_FAILURE); }
-	bphf->save(os);
-	os.close();
+	HeaderIndexFile header;
+	header.k = k == 0 ? MAX_K_64 : k;
+	if(canonical) header.flags |= INDEX_FLAG_CANONICAL;
+	write_initial_database(filename_db, initial_kmers, header.k, db_flags);
+	save_index(filename_index, bphf, header);
 
 	delete bphf;
 
-	return 0;
-
 }
 
 
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <string>
 #include <array>
@@ -33,6 +34,9 @@ void usage_kmodify() {
 	exit(EXIT_FAILURE);
 }
 
+template<typename KmerT>
+static int modify_database(const std::string & filename_index, const std::string & filename_db, const std::string & filename_commands);
+
 int main_kmodify(int argc, char** argv) {
 
 	bool debug = false;
@@ -66,29 +70,40 @@ int main_kmodify(int argc, char** argv) {
 	if(filename_db.length() == 0) { error("Please specify the name of the database file, using the -k option."); usage_kmodify(); }
 	if(filename_commands.length() == 0) { error("Please specify the name of the modification file, using the -c option."); usage_kmodify(); }
 
-	boophf_t * bphf = new boomphf::mphf<u_int64_t,hasher_t>();
-	load_index(filename_index, bphf);
+	// the k-mers are held in 64 bit up to MAX_K_64 and in 128 bit above
+	if(load_index_header(filename_index).k > MAX_K_64) return modify_database<Kmer128>(filename_index, filename_db, filename_commands);
+	return modify_database<Kmer>(filename_index, filename_db, filename_commands);
+
+}
+
+template<typename KmerT>
+static int modify_database(const std::string & filename_index, const std::string & filename_db, const std::string & filename_commands) {
+
+	boophf<KmerT> * bphf = new boophf<KmerT>();
+	const HeaderIndexFile index_header = load_index(filename_index, bphf);
 
-	KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
-	std::vector<Kmer> initial_kmers;
-	pCountMap * kmer2countmap = new pCountMap[n_elem](); // init new array of size n_elem
+	std::vector<KmerT> initial_kmers;
+	KmerPostings postings;
 	ExpId2Name exp_id2name;
 	ExpId2Desc exp_id2desc;
 	ExpName2Id exp_name2id;
 	ExpId2ReadCount exp_id2readcount;
 
 	try {
-		read_database(filename_db, initial_kmers, kmer2countmap, bphf, true, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+		read_database(filename_db, initial_kmers, postings, bphf, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
 	}
 	catch(std::runtime_error e) {
 		std::cerr << "Error while reading database (" << e.what() << ")." << std::endl;
 		exit(EXIT_FAILURE);
 	}
+	// the database is written again in the same format
+	const uint32_t db_flags = database_flags(filename_db);
 
 
 	std::ifstream ifs(filename_commands);
 	if(!ifs) { std::cerr << "Cannot open file " << filename_commands << std::endl; exit(EXIT_FAILURE); }
 
+	std::set<ExperimentId> deleted_exp_ids;
 	std::string line;
 	while(getline(ifs, line)) {
 		if(line.length() == 0) { continue; }
@@ -118,18 +133,8 @@ int main_kmodify(int argc, char** argv) {
 
 		if(command=="delete") {
 			ExperimentId exp_id = exp_name2id.at(experiment_name);
-			// delete experiment from all k-mers
-			for(Kmer it : initial_kmers) {
-				KmerIndex index = bphf->lookup(it);
-				ExperimentCount num_exp = kmer2countmap[index]==nullptr ? 0 : static_cast<ExperimentCount>(kmer2countmap[index]->size());
-				if(num_exp > 0) {
-					pCountMap m = kmer2countmap[index];
-					auto it = m->find(exp_id);
-					if(it != m->end()) {
-						m->erase(it);
-					}
-				}
-			}
+			// the experiment is deleted from all k-mers after reading all commands
+			deleted_exp_ids.insert(exp_id);
 			exp_name2id.erase(experiment_name);
 			exp_id2name.erase(exp_id);
 			exp_id2desc.erase(exp_id);
@@ -146,15 +151,9 @@ int main_kmodify(int argc, char** argv) {
 
 	}
 
+	if(!deleted_exp_ids.empty()) postings.removeExperiments(deleted_exp_ids);
 
-	write_database(filename_db, initial_kmers, kmer2countmap, bphf, exp_id2name, exp_id2desc, exp_id2readcount);
-
-	for(KmerIndex i = 0; i < n_elem;i++) {
-		if(kmer2countmap[i] != nullptr) {
-			delete kmer2countmap[i];
-		}
-	}
-	delete[] kmer2countmap;
+	write_database(filename_db, initial_kmers, postings, bphf, exp_id2name, exp_id2desc, exp_id2readcount, index_header.k, db_flags);
 	delete bphf;
 
 	return 0;
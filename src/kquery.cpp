@@ -9,15 +9,21 @@
 #include <algorithm>
 #include <string>
 #include <deque>
+#include <memory>
 #include <stdexcept>
 
 #include "BooPHF/BooPHF.h"
 #include "util.hpp"
+#include "DatabaseView.hpp"
 
 void usage_kquery();
-void run_query(const std::string & query, bool json, uint32_t threshold, uint32_t rpm_threshold, const std::vector<Kmer> & initial_kmers, boophf_t * bphf, pCountMap * kmer2countmap, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount);
-void run_query_all(const std::string & query, bool first, std::set<ExperimentId> &, uint32_t threshold, uint32_t rpm_threshold, const std::vector<Kmer> & initial_kmers, boophf_t * bphf, pCountMap * kmer2countmap, const ExpId2ReadCount & exp_id2readcount);
+template<typename KmerT>
+void run_query(const std::string & query, bool json, uint32_t threshold, uint32_t rpm_threshold, const HeaderIndexFile & index_header, const DatabaseView<KmerT> & db, boophf<KmerT> * bphf, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount);
+template<typename KmerT>
+void run_query_all(const std::string & query, bool first, std::set<ExperimentId> &, uint32_t threshold, uint32_t rpm_threshold, const HeaderIndexFile & index_header, const DatabaseView<KmerT> & db, boophf<KmerT> * bphf, const ExpId2ReadCount & exp_id2readcount);
 void print_exp_set(std::set<ExperimentId> & exp_set, ExpId2Name & exp_id2name, ExpId2Desc & exp_id2desc, bool json);
+template<typename KmerT>
+int query_database(const std::string & filename_index, const std::string & filename_db, const std::string & filename_query, const std::string & arg_query, bool json, bool all_kmers, uint32_t threshold, uint32_t rpm_threshold);
 
 int main_kquery(int argc, char** argv) {
 
@@ -87,19 +93,28 @@ int main_kquery(int argc, char** argv) {
 	if(filename_query.length() == 0 && arg_query.length() == 0) { error("Please specify either a query file with -q or the query k-mer(s) directly with -Q."); usage_kquery(); }
 	if(filename_query.length() > 0 && arg_query.length() > 0) { error("Please specify only one of the options -q and -Q."); usage_kquery(); }
 
-	boophf_t * bphf = new boomphf::mphf<u_int64_t,hasher_t>();
-	load_index(filename_index,bphf);
+	// the k-mers are held in 64 bit up to MAX_K_64 and in 128 bit above
+	if(load_index_header(filename_index).k > MAX_K_64) return query_database<Kmer128>(filename_index, filename_db, filename_query, arg_query, json, all_kmers, threshold, rpm_threshold);
+	return query_database<Kmer>(filename_index, filename_db, filename_query, arg_query, json, all_kmers, threshold, rpm_threshold);
+
+}
+
+template<typename KmerT>
+int query_database(const std::string & filename_index, const std::string & filename_db, const std::string & filename_query, const std::string & arg_query, bool json, bool all_kmers, uint32_t threshold, uint32_t rpm_threshold) {
+
+	boophf<KmerT> * bphf = new boophf<KmerT>();
+	// queries are converted to canonical k-mers when the index contains only those
+	const HeaderIndexFile index_header = load_index(filename_index,bphf);
 
-	KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
-	std::vector<Kmer> initial_kmers;
-	pCountMap * kmer2countmap = new pCountMap[n_elem](); // init new array of size n_elem
 	ExpId2Name exp_id2name;
 	ExpId2Desc exp_id2desc;
 	ExpName2Id exp_name2id;
 	ExpId2ReadCount exp_id2readcount;
 
+	// only the pages of the query k-mers are read from a mapped database file
+	std::unique_ptr<DatabaseView<KmerT>> db;
 	try {
-		read_database(filename_db, initial_kmers, kmer2countmap, bphf, true, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+		db.reset(new DatabaseView<KmerT>(filename_db, bphf, false, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount));
 	}
 	catch(std::runtime_error e) {
 		std::cerr << "Error while reading database (" << e.what() << ")." << std::endl;
@@ -114,12 +129,12 @@ int main_kquery(int argc, char** argv) {
 			std::string q = arg_query.substr(0,pos);
 			if(!all_kmers) {
 				if(json) { std::cout << "{ \"results\" : [ "; }
-				run_query(q, json, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2name, exp_id2desc, exp_id2readcount);
+				run_query(q, json, threshold, rpm_threshold, index_header, *db, bphf, exp_id2name, exp_id2desc, exp_id2readcount);
 				size_t start = pos+1;
 				while((pos = arg_query.find(",",start)) != std::string::npos) {
 					q = arg_query.substr(start,pos - start);
 					if(json) { std::cout << ", "; }
-					run_query(q, json, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2name, exp_id2desc, exp_id2readcount);
+					run_query(q, json, threshold, rpm_threshold, index_header, *db, bphf, exp_id2name, exp_id2desc, exp_id2readcount);
 					start = pos +1;
 				}
 				if(json) { std::cout << " ] }\n"; }
@@ -127,25 +142,25 @@ int main_kquery(int argc, char** argv) {
 			else { // all k-mers
 				std::set<ExperimentId> exp_set;
 				// process first k-mer
-				run_query_all(q, true, exp_set, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2readcount);
+				run_query_all(q, true, exp_set, threshold, rpm_threshold, index_header, *db, bphf, exp_id2readcount);
 				if(!exp_set.empty()) {
 					// do remaining k-mers
 					size_t start = pos+1;
 					while((pos = arg_query.find(",",start)) != std::string::npos) {
 						q = arg_query.substr(start,pos - start);
-						run_query_all(q, false, exp_set, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2readcount);
+						run_query_all(q, false, exp_set, threshold, rpm_threshold, index_header, *db, bphf, exp_id2readcount);
 						start = pos +1;
 					}
 					// last k-mer after last ,
 					q = arg_query.substr(start);
-					run_query_all(q, false, exp_set, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2readcount);
+					run_query_all(q, false, exp_set, threshold, rpm_threshold, index_header, *db, bphf, exp_id2readcount);
 				}
 				print_exp_set(exp_set, exp_id2name, exp_id2desc, json);
 			}
 
 		}
 		else { // single k-mer query
-			run_query(arg_query, json, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2name, exp_id2desc, exp_id2readcount);
+			run_query(arg_query, json, threshold, rpm_threshold, index_header, *db, bphf, exp_id2name, exp_id2desc, exp_id2readcount);
 		}
 	}
 	else if(filename_query.length() > 0) {
@@ -159,26 +174,26 @@ int main_kquery(int argc, char** argv) {
 
 		std::cerr << getCurrentTime() << " Start reading k-mers from file " << filename_query << "\n";
 		std::string line_from_file;
-		line_from_file.reserve(KMER_K + 1);
+		line_from_file.reserve(index_header.k + 1);
 		// query k-mers to DB:
 		if(!all_kmers && json) { std::cout << "{ \"results\" : [ "; }
 		while(getline(filestream_kmers,line_from_file)) {
 			if(line_from_file.length() == 0) { continue; }
 			if(!all_kmers) {
 				if(json) { if(!first) { std::cout << ", "; } else { first = false; } }
-				run_query(line_from_file, json, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2name, exp_id2desc, exp_id2readcount);
+				run_query(line_from_file, json, threshold, rpm_threshold, index_header, *db, bphf, exp_id2name, exp_id2desc, exp_id2readcount);
 			}
 			else {
 				if(!first) {
 					if(!exp_set.empty()) {
-						run_query_all(line_from_file, false, exp_set, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2readcount);
+						run_query_all(line_from_file, false, exp_set, threshold, rpm_threshold, index_header, *db, bphf, exp_id2readcount);
 					}
 					else {
 						break;
 					}
 				}
 				else {
-					run_query_all(line_from_file, true, exp_set, threshold, rpm_threshold, initial_kmers, bphf, kmer2countmap, exp_id2readcount);
+					run_query_all(line_from_file, true, exp_set, threshold, rpm_threshold, index_header, *db, bphf, exp_id2readcount);
 					first = false;
 				}
 			}
@@ -195,35 +210,33 @@ int main_kquery(int argc, char** argv) {
 	}
 
 	// finished search, cleanup
-
-	for(KmerIndex i = 0; i < n_elem;i++) {
-		if(kmer2countmap[i] != nullptr) {
-			delete kmer2countmap[i];
-		}
-	}
-
-	delete[] kmer2countmap;
 	delete bphf;
 
 	return 0;
 
 }
 
-void run_query(const std::string & query, bool json, uint32_t threshold, uint32_t rpm_threshold, const std::vector<Kmer> & initial_kmers, boophf_t * bphf, pCountMap * kmer2countmap, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount) {
-		if(query.length() < KMER_K){ printf("Warning, query too short:%s\n",query.c_str()); return; }
-		if(query.length() > KMER_K){ printf("Warning, query too long:%s\n",query.c_str()); return; }
-		Kmer kmer = str_to_int(query);
+template<typename KmerT>
+void run_query(const std::string & query, bool json, uint32_t threshold, uint32_t rpm_threshold, const HeaderIndexFile & index_header, const DatabaseView<KmerT> & db, boophf<KmerT> * bphf, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount) {
+		const unsigned k = index_header.k;
+		if(query.length() < k){ printf("Warning, query too short:%s\n",query.c_str()); return; }
+		if(query.length() > k){ printf("Warning, query too long:%s\n",query.c_str()); return; }
+		if(!is_dna(query)){ printf("Warning, query contains characters other than ACGT:%s\n",query.c_str()); return; }
+		KmerT kmer = str_to_int<KmerT>(query);
+		if(index_header.flags & INDEX_FLAG_CANONICAL) kmer = canonical_kmer(kmer, k);
 		//std::cerr << getCurrentTime() << " Searching " << query << "\n";
 		if(json) std::cout << "{ \"query\" : \"" <<query << "\", \"experiments\" : [ ";
-		if(std::binary_search(initial_kmers.begin(), initial_kmers.end(), kmer)) {
+		if(db.contains(kmer)) {
 			// kmer was found in initial set, then check if it has counts in database
 			KmerIndex index = bphf->lookup(kmer);
 			assert(index < bphf->nbKeys());
-			if(kmer2countmap[index] != nullptr) {
+			typename DatabaseView<KmerT>::PostingBuffer buffer;
+			const typename DatabaseView<KmerT>::PostingList postings = db.postingList(index, buffer);
+			if(postings.size > 0) {
 				bool first = true;
-				for(auto const & it : *kmer2countmap[index]) { // go through all experiments that have counts for this k-mer
-					ExperimentId exp_id = it.first;
-					KmerCount count = it.second;
+				for(ExperimentCount p = 0; p < postings.size; p++) { // go through all experiments that have counts for this k-mer
+					ExperimentId exp_id = postings.exp_ids[p];
+					KmerCount count = postings.counts[p];
 					assert(exp_id2readcount.find(exp_id) != exp_id2readcount.end());
 					double rpm = (double)count / (double)exp_id2readcount.at(exp_id) * 1e6;
 					if(count > threshold && rpm > rpm_threshold) {
@@ -251,21 +264,27 @@ void run_query(const std::string & query, bool json, uint32_t threshold, uint32_
 		if(json) std::cout << "]}\n";
 }
 
-void run_query_all(const std::string & query, bool first, std::set<ExperimentId> & exp_set, uint32_t threshold, uint32_t rpm_threshold, const std::vector<Kmer> & initial_kmers, boophf_t * bphf, pCountMap * kmer2countmap, const ExpId2ReadCount & exp_id2readcount) {
-		if(query.length() < KMER_K){ printf("Warning, query too short:%s\n",query.c_str()); return; }
-		if(query.length() > KMER_K){ printf("Warning, query too long:%s\n",query.c_str()); return; }
+template<typename KmerT>
+void run_query_all(const std::string & query, bool first, std::set<ExperimentId> & exp_set, uint32_t threshold, uint32_t rpm_threshold, const HeaderIndexFile & index_header, const DatabaseView<KmerT> & db, boophf<KmerT> * bphf, const ExpId2ReadCount & exp_id2readcount) {
+		const unsigned k = index_header.k;
+		if(query.length() < k){ printf("Warning, query too short:%s\n",query.c_str()); return; }
+		if(query.length() > k){ printf("Warning, query too long:%s\n",query.c_str()); return; }
+		if(!is_dna(query)){ printf("Warning, query contains characters other than ACGT:%s\n",query.c_str()); return; }
 
-		Kmer kmer = str_to_int(query);
+		KmerT kmer = str_to_int<KmerT>(query);
+		if(index_header.flags & INDEX_FLAG_CANONICAL) kmer = canonical_kmer(kmer, k);
 		std::cerr << getCurrentTime() << " Searching " << query << "\n";
-		if(std::binary_search(initial_kmers.begin(), initial_kmers.end(), kmer)) {
+		if(db.contains(kmer)) {
 			// kmer was found in initial set, then check if it has counts in database
 			KmerIndex index = bphf->lookup(kmer);
 			assert(index < bphf->nbKeys());
 			std::set<ExperimentId> curr_exp_set;
-			if(kmer2countmap[index] != nullptr) {
-				for(auto const & it : *kmer2countmap[index]) { // go through all experiments that have counts for this k-mer
-					ExperimentId exp_id = it.first;
-					KmerCount count = it.second;
+			typename DatabaseView<KmerT>::PostingBuffer buffer;
+			const typename DatabaseView<KmerT>::PostingList postings = db.postingList(index, buffer);
+			if(postings.size > 0) {
+				for(ExperimentCount p = 0; p < postings.size; p++) { // go through all experiments that have counts for this k-mer
+					ExperimentId exp_id = postings.exp_ids[p];
+					KmerCount count = postings.counts[p];
 					assert(exp_id2readcount.find(exp_id) != exp_id2readcount.end());
 					double rpm = (double)count / (double)exp_id2readcount.at(exp_id) * 1e6;
 					if(count > threshold && rpm > rpm_threshold) {
@@ -29,6 +29,7 @@
 #include "kdb.hpp"
 #include "kdump.hpp"
 #include "kmodify.hpp"
+#include "kcompact.hpp"
 #ifdef KIQ_SRA
 #include "ksra.hpp"
 #endif
@@ -63,6 +64,8 @@ int main(int argc, char** argv) {
 		ret = main_kdump(argc-1, argv+1);
 	else if(strcmp(argv[1], "modify") == 0)
 		ret = main_kmodify(argc-1, argv+1);
+	else if(strcmp(argv[1], "compact") == 0)
+		ret = main_kcompact(argc-1, argv+1);
 	else {
 		ret = 1;
 		usage();
@@ -74,9 +77,9 @@ int main(int argc, char** argv) {
 void usage() {
 	print_usage_header();
 #ifdef KIQ_SRA
-	fprintf(stderr, "Usage:\n   kiq [ index | db | sra | query | dump | modify ] ...\n");
+	fprintf(stderr, "Usage:\n   kiq [ index | db | sra | query | dump | modify | compact ] ...\n");
 #else
-	fprintf(stderr, "Usage:\n   kiq [ index | db | query | dump | modify ] ...\n");
+	fprintf(stderr, "Usage:\n   kiq [ index | db | query | dump | modify | compact ] ...\n");
 #endif
 	fprintf(stderr, "\n");
 	fprintf(stderr, "     index    create index from initial list of k-mers\n");
@@ -87,5 +90,6 @@ void usage() {
 	fprintf(stderr, "     query    query k-mers against count database\n");
 	fprintf(stderr, "     dump     print database content / stats\n");
 	fprintf(stderr, "     modify   modify database content\n");
+	fprintf(stderr, "     compact  merge segment log into database file\n");
 
 }
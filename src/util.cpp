@@ -1,45 +1,180 @@
 #include "util.hpp"
+#include "IngestPostings.hpp"
+#include "PostingCodec.hpp"
+#include "DatabaseFile.hpp"
+#include "Inflater.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <algorithm>
+#include <limits>
+#include <memory>
+#include <thread>
 
-void write_database(const std::string & filename, const std::vector<Kmer> & initial_kmers, pCountMap * kmer2countmap, boophf_t * bphf, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount) {
+// the number of postings of a k-mer and f(exp_id, count) for each of them, in the order of the experiment ids
+static ExperimentCount num_experiments(const IngestPostings & postings, KmerIndex index) {
+	return postings.numExperiments(index);
+}
+
+template<typename F>
+static void for_each_posting(const IngestPostings & postings, KmerIndex index, F f) {
+	postings.forEach(index, [&](const IngestPostings::Posting & p) { f(p.exp_id, p.count); });
+}
+
+static ExperimentCount num_experiments(const KmerPostings & postings, KmerIndex index) {
+	return postings.numExperiments(index);
+}
+
+template<typename F>
+static void for_each_posting(const KmerPostings & postings, KmerIndex index, F f) {
+	for(uint64_t p = postings.offsets[index]; p < postings.offsets[index + 1]; p++) f(postings.exp_ids[p], postings.counts[p]);
+}
+
+// returns the size of the complete segments at the beginning of the segment log, only their headers are read
+static uint64_t complete_segments_size(std::istream & ifs, uint64_t file_size) {
+	ifs.seekg(0);
+	uint64_t complete_size = 0;
+	while(true) {
+		struct HeaderDbSegment s_in;
+		ifs.read(reinterpret_cast<char*>(&s_in.label), sizeof(s_in.label));
+		ifs.read(reinterpret_cast<char*>(&s_in.size), sizeof(s_in.size));
+		if(!ifs.good()) break;
+		const uint64_t segment_end = complete_size + sizeof(s_in.label) + sizeof(s_in.size) + s_in.size;
+		if(segment_end > file_size) break;
+		complete_size = segment_end;
+		ifs.seekg(static_cast<std::streamoff>(complete_size));
+	}
+	ifs.clear();
+	return complete_size;
+}
+
+// returns the CRC-32 of the first size bytes of the segment log, which is at least this long
+static uint32_t segment_log_crc(std::istream & ifs, uint64_t size) {
+	ifs.seekg(0);
+	std::vector<char> chunk(1 << 20);
+	uint32_t crc = 0;
+	while(size > 0 && ifs.good()) {
+		const size_t n = static_cast<size_t>(std::min(size, static_cast<uint64_t>(chunk.size())));
+		ifs.read(chunk.data(), static_cast<std::streamsize>(n));
+		crc = Inflater::crc32(chunk.data(), n, crc);
+		size -= n;
+	}
+	ifs.clear();
+	return crc;
+}
+
+/**
+* Writes the database file in the current version with the postings of an
+* IngestPostings or KmerPostings.
+*/
+template<typename KmerT, typename Postings>
+static void write_database_file(const std::string & filename, const std::vector<KmerT> & initial_kmers, const Postings & postings, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount, unsigned k, uint32_t flags) {
 
 	std::cerr << getCurrentTime() << " Writing k-mer database to file " << filename << "\n";
-	std::ofstream os(filename, std::ios::out | std::ios::binary);
-	if(!os.is_open()) {  error("Could not open file " + filename); exit(EXIT_FAILURE); }
+	// the database is written to a temporary file first, which replaces the
+	// database file once it is complete
+	const std::string filename_tmp = filename + ".tmp";
+	std::ofstream os(filename_tmp, std::ios::out | std::ios::binary);
+	if(!os.is_open()) {  error("Could not open file " + filename_tmp); exit(EXIT_FAILURE); }
 
 	// write header
 	struct HeaderDbFile hdr;
+	hdr.flags = flags & ~DB_FLAG_MERGED_LOG;
+	hdr.k = k;
+	// the segments in the log have been read into the postings, or do not
+	// belong to a new database, and are recorded as contained in the file
+	const std::string filename_log = segment_log_filename(filename);
+	std::ifstream log(filename_log, std::ios::in | std::ios::binary | std::ios::ate);
+	if(log) {
+		hdr.mergedLogSize = complete_segments_size(log, static_cast<uint64_t>(log.tellg()));
+		hdr.mergedLogCrc = segment_log_crc(log, hdr.mergedLogSize);
+		if(hdr.mergedLogSize > 0) hdr.flags |= DB_FLAG_MERGED_LOG;
+	}
+	log.close();
 	os.write(reinterpret_cast<const char *>(&hdr.magic),sizeof(hdr.magic));
 	os.write(reinterpret_cast<const char *>(&hdr.dbVer),sizeof(hdr.dbVer));
+	os.write(reinterpret_cast<const char *>(&hdr.flags),sizeof(hdr.flags));
+	os.write(reinterpret_cast<const char *>(&hdr.k),sizeof(hdr.k));
+	if(hdr.flags & DB_FLAG_MERGED_LOG) {
+		os.write(reinterpret_cast<const char *>(&hdr.mergedLogSize),sizeof(hdr.mergedLogSize));
+		os.write(reinterpret_cast<const char *>(&hdr.mergedLogCrc),sizeof(hdr.mergedLogCrc));
+		os.write(reinterpret_cast<const char *>(&hdr.padding),sizeof(hdr.padding));
+	}
+
+	// the rest of the file is written to out, which compresses it in blocks with DB_FLAG_BLOCKS
+	std::unique_ptr<BlockWriter> block_writer;
+	std::ostream block_stream(nullptr);
+	if(flags & DB_FLAG_BLOCKS) {
+		block_writer.reset(new BlockWriter(os, std::thread::hardware_concurrency()));
+		block_stream.rdbuf(block_writer.get());
+	}
+	std::ostream & out = block_writer ? block_stream : os;
 
 	struct HeaderDbKmers hdr_k;
 	hdr_k.numKmer = initial_kmers.size();
-	os.write(reinterpret_cast<const char *>(&hdr_k.numKmer),sizeof(hdr_k.numKmer));
-
-	for(Kmer it : initial_kmers) {
-		KmerIndex index = bphf->lookup(it);
-		assert(index < bphf->nbKeys());
-		Kmer kmer = it;
-		// write k-mer
-		os.write(reinterpret_cast<const char *>(&kmer),sizeof(kmer));
-		// write number of experiments having this k-mer
-		ExperimentCount num_exp = kmer2countmap[index]==nullptr ? 0 : static_cast<ExperimentCount>(kmer2countmap[index]->size());
-		os.write(reinterpret_cast<const char *>(&num_exp),sizeof(num_exp));
-		if(num_exp > 0) {
-			for(auto const & it_exp : *kmer2countmap[index]) {
-				ExperimentId exp_id = it_exp.first;
+	out.write(reinterpret_cast<const char *>(&hdr_k.numKmer),sizeof(hdr_k.numKmer));
+	if(sizeof(KmerT) > sizeof(Kmer)) {
+		// aligns the 128 bit k-mers to 16 bytes
+		const uint64_t padding = 0;
+		out.write(reinterpret_cast<const char *>(&padding),sizeof(padding));
+	}
+	out.write(reinterpret_cast<const char *>(initial_kmers.data()),static_cast<std::streamsize>(initial_kmers.size() * sizeof(KmerT)));
+
+	if(flags & DB_FLAG_COMPRESSED) {
+		// the byte offsets of the compressed lists are summed up in a first pass
+		// over the postings, and the lists are encoded again in a second pass
+		std::vector<ExperimentId> exp_ids;
+		std::vector<KmerCount> counts;
+		std::vector<uint8_t> encoded;
+		auto collect = [&](KmerIndex index) {
+			exp_ids.clear();
+			counts.clear();
+			for_each_posting(postings, index, [&](ExperimentId exp_id, KmerCount count) {
 				assert(exp_id2name.find(exp_id) != exp_id2name.end());
-				KmerCount count = kmer2countmap[index]->at(it_exp.first);
-				os.write(reinterpret_cast<const char *>(&exp_id),sizeof(exp_id));
-				os.write(reinterpret_cast<const char *>(&count),sizeof(count));
-			}
+				exp_ids.push_back(exp_id);
+				counts.push_back(count);
+			});
+		};
+		uint64_t offset = 0;
+		out.write(reinterpret_cast<const char *>(&offset),sizeof(offset));
+		for(KmerIndex index = 0; index < hdr_k.numKmer; index++) {
+			collect(index);
+			offset += encoded_postings_size(exp_ids.data(), counts.data(), static_cast<ExperimentCount>(exp_ids.size()));
+			out.write(reinterpret_cast<const char *>(&offset),sizeof(offset));
+		}
+		for(KmerIndex index = 0; index < hdr_k.numKmer; index++) {
+			collect(index);
+			encoded.resize(encoded_postings_size(exp_ids.data(), counts.data(), static_cast<ExperimentCount>(exp_ids.size())));
+			encode_postings(exp_ids.data(), counts.data(), static_cast<ExperimentCount>(exp_ids.size()), encoded.data());
+			out.write(reinterpret_cast<const char *>(encoded.data()),static_cast<std::streamsize>(encoded.size()));
+		}
+	}
+	else {
+		// the offsets table and then the experiment ids and counts in the order of the MPHF indices
+		uint64_t offset = 0;
+		out.write(reinterpret_cast<const char *>(&offset),sizeof(offset));
+		for(KmerIndex index = 0; index < hdr_k.numKmer; index++) {
+			offset += num_experiments(postings, index);
+			out.write(reinterpret_cast<const char *>(&offset),sizeof(offset));
+		}
+		for(KmerIndex index = 0; index < hdr_k.numKmer; index++) {
+			for_each_posting(postings, index, [&](ExperimentId exp_id, KmerCount) {
+				assert(exp_id2name.find(exp_id) != exp_id2name.end());
+				out.write(reinterpret_cast<const char *>(&exp_id),sizeof(exp_id));
+			});
+		}
+		for(KmerIndex index = 0; index < hdr_k.numKmer; index++) {
+			for_each_posting(postings, index, [&](ExperimentId, KmerCount count) {
+				out.write(reinterpret_cast<const char *>(&count),sizeof(count));
+			});
 		}
 	}
 
 	struct HeaderDbMetadata hdr_m;
 	hdr_m.numExp = exp_id2name.size();
-	os.write(reinterpret_cast<const char *>(&hdr_m.label),sizeof(hdr_m.label));
-	os.write(reinterpret_cast<const char *>(&hdr_m.numExp),sizeof(hdr_m.numExp));
+	out.write(reinterpret_cast<const char *>(&hdr_m.label),sizeof(hdr_m.label));
+	out.write(reinterpret_cast<const char *>(&hdr_m.numExp),sizeof(hdr_m.numExp));
 
 	for(auto const & it : exp_id2name) {
 		const ExperimentId exp_id = it.first;
@@ -49,69 +184,482 @@ void write_database(const std::string & filename, const std::vector<Kmer> & init
 		assert(exp_id2readcount.count(exp_id) > 0);
 		const ReadCount readcount = exp_id2readcount.at(exp_id);
 
-		os.write(reinterpret_cast<const char *>(&exp_id),sizeof(ExperimentId));
-		os.write(reinterpret_cast<const char *>(&readcount),sizeof(ReadCount));
-		os.write(exp_name.c_str(),exp_name.length() + 1);
-		os.write(exp_desc.c_str(),exp_desc.length() + 1);
+		out.write(reinterpret_cast<const char *>(&exp_id),sizeof(ExperimentId));
+		out.write(reinterpret_cast<const char *>(&readcount),sizeof(ReadCount));
+		out.write(exp_name.c_str(),exp_name.length() + 1);
+		out.write(exp_desc.c_str(),exp_desc.length() + 1);
+	}
+
+	if(block_writer) {
+		if(!block_stream) { error("Compressing the database failed."); exit(EXIT_FAILURE); }
+		try {
+			block_writer->finish();
+		}
+		catch(std::exception & e) {
+			error("Compressing the database failed: " + std::string(e.what())); exit(EXIT_FAILURE);
+		}
 	}
 
 	os.close();
 	if(!os) { // writing failed at some point
-		error("Writing to file " + filename + "failed."); exit(EXIT_FAILURE);
+		error("Writing to file " + filename_tmp + "failed."); exit(EXIT_FAILURE);
+	}
+
+	// the segments are contained in the new database file now, which replaces
+	// the old one before the segment log is removed. If kiq is interrupted in
+	// between, the merged segments are skipped by their size and CRC-32 in the
+	// header, so that they are neither lost nor counted twice.
+	if(rename(filename_tmp.c_str(), filename.c_str()) != 0) {
+		error("Could not rename file " + filename_tmp + " to " + filename); exit(EXIT_FAILURE);
+	}
+	if(remove(filename_log.c_str()) != 0 && errno != ENOENT) {
+		error("Could not remove file " + filename_log); exit(EXIT_FAILURE);
 	}
 }
 
+template<typename KmerT>
+void write_database(const std::string & filename, const std::vector<KmerT> & initial_kmers, const IngestPostings & kmer2postings, boophf<KmerT> * bphf, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount, unsigned k, uint32_t flags) {
+	assert(initial_kmers.size() == bphf->nbKeys());
+	write_database_file(filename, initial_kmers, kmer2postings, exp_id2name, exp_id2desc, exp_id2readcount, k, flags);
+}
 
-void write_initial_database(const std::string & filename, const std::vector<Kmer> & initial_kmers) {
-	std::cerr << getCurrentTime() << " Writing k-mer database to file " << filename << "\n";
-	std::ofstream os(filename, std::ios::out | std::ios::binary);
-	if(!os.is_open()) {  error("Could not open file " + filename); exit(EXIT_FAILURE); }
+template<typename KmerT>
+void write_database(const std::string & filename, const std::vector<KmerT> & initial_kmers, const KmerPostings & postings, boophf<KmerT> * bphf, const ExpId2Name & exp_id2name, const ExpId2Desc & exp_id2desc, const ExpId2ReadCount & exp_id2readcount, unsigned k, uint32_t flags) {
+	assert(initial_kmers.size() == bphf->nbKeys());
+	write_database_file(filename, initial_kmers, postings, exp_id2name, exp_id2desc, exp_id2readcount, k, flags);
+}
 
-	// write header
-	struct HeaderDbFile hdr;
-	os.write(reinterpret_cast<const char *>(&hdr.magic),sizeof(hdr.magic));
-	os.write(reinterpret_cast<const char *>(&hdr.dbVer),sizeof(hdr.dbVer));
+uint32_t database_flags(const std::string & filename) {
+	std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+	struct HeaderDbFile h_in;
+	ifs.read(reinterpret_cast<char*>(&h_in.magic), sizeof(h_in.magic));
+	ifs.read(reinterpret_cast<char*>(&h_in.dbVer), sizeof(h_in.dbVer));
+	if(!ifs.good() || h_in.dbVer < DB_VERSION_FLAGS) return 0;
+	ifs.read(reinterpret_cast<char*>(&h_in.flags), sizeof(h_in.flags));
+	return ifs.good() ? (h_in.flags & ~DB_FLAG_MERGED_LOG) : 0;
+}
 
-	struct HeaderDbKmers hdr_k;
-	hdr_k.numKmer = initial_kmers.size();
-	os.write(reinterpret_cast<const char *>(&hdr_k.numKmer),sizeof(hdr_k.numKmer));
+template<typename KmerT>
+void write_initial_database(const std::string & filename, const std::vector<KmerT> & initial_kmers, unsigned k, uint32_t flags) {
+	// segments of a previous database with the same name do not belong to the new one,
+	// and are removed together with writing the empty database
+	KmerPostings postings;
+	postings.offsets.assign(initial_kmers.size() + 1, 0);
+	write_database_file(filename, initial_kmers, postings, ExpId2Name(), ExpId2Desc(), ExpId2ReadCount(), k, flags);
+}
 
-	KmerCount count = 0;
-	for(Kmer it : initial_kmers) {
-		// write k-mer
-		Kmer kmer = it;
-		os.write(reinterpret_cast<const char *>(&kmer),sizeof(kmer));
-		// write 0
-		os.write(reinterpret_cast<const char *>(&count),sizeof(count));
+
+std::string segment_log_filename(const std::string & filename_db) {
+	return filename_db + ".log";
+}
+
+/**
+* Returns the size of the segments at the beginning of the segment log that
+* the header of the database file records as merged, if the log still starts
+* with them, and 0 otherwise, e.g. for a log started after they were removed.
+*/
+uint64_t merged_segments_size(const std::string & filename_db) {
+	std::ifstream ifs(filename_db, std::ios::in | std::ios::binary);
+	if(!ifs) return 0;
+	HeaderDbFile h_in;
+	try {
+		h_in = read_database_header(ifs);
 	}
+	catch(std::runtime_error &) { // reported when the database is read
+		return 0;
+	}
+	if(!(h_in.flags & DB_FLAG_MERGED_LOG)) return 0;
+	std::ifstream log(segment_log_filename(filename_db), std::ios::in | std::ios::binary | std::ios::ate);
+	if(!log || static_cast<uint64_t>(log.tellg()) < h_in.mergedLogSize) return 0;
+	return segment_log_crc(log, h_in.mergedLogSize) == h_in.mergedLogCrc ? h_in.mergedLogSize : 0;
+}
 
-	struct HeaderDbMetadata hdr_m;
-	hdr_m.numExp = 0;
-	os.write(reinterpret_cast<const char *>(&hdr_m.label),sizeof(hdr_m.label));
-	os.write(reinterpret_cast<const char *>(&hdr_m.numExp),sizeof(hdr_m.numExp));
+bool has_segments(const std::string & filename_db) {
+	std::ifstream log(segment_log_filename(filename_db), std::ios::in | std::ios::binary | std::ios::ate);
+	return log && static_cast<uint64_t>(log.tellg()) > merged_segments_size(filename_db);
+}
+
+void repair_segment_log(const std::string & filename_db) {
+	const std::string filename = segment_log_filename(filename_db);
+	std::ifstream ifs(filename, std::ios::in | std::ios::binary | std::ios::ate);
+	if(!ifs) return;
+	const uint64_t file_size = static_cast<uint64_t>(ifs.tellg());
+	const uint64_t complete_size = complete_segments_size(ifs, file_size);
+	ifs.close();
+	if(complete_size < file_size) {
+		std::cerr << "Warning: Removing incomplete segment at the end of file " << filename << ".\n";
+		if(truncate(filename.c_str(), static_cast<off_t>(complete_size)) != 0) {
+			error("Could not truncate file " + filename); exit(EXIT_FAILURE);
+		}
+	}
 
+	// left over from a merge that was interrupted before removing the log
+	const uint64_t merged_size = merged_segments_size(filename_db);
+	if(merged_size == 0) return;
+	std::cerr << "Warning: Removing segments from file " << filename << ", which are already contained in the database.\n";
+	if(merged_size == complete_size) {
+		if(remove(filename.c_str()) != 0) { error("Could not remove file " + filename); exit(EXIT_FAILURE); }
+		return;
+	}
+	// the remaining segments are copied to a new log, which replaces the old one
+	const std::string filename_tmp = filename + ".tmp";
+	std::ifstream in(filename, std::ios::in | std::ios::binary);
+	in.seekg(static_cast<std::streamoff>(merged_size));
+	std::ofstream os(filename_tmp, std::ios::out | std::ios::binary);
+	if(!os.is_open()) { error("Could not open file " + filename_tmp); exit(EXIT_FAILURE); }
+	os << in.rdbuf();
+	os.close();
+	if(!in || !os) { error("Writing to file " + filename_tmp + " failed."); exit(EXIT_FAILURE); }
+	if(rename(filename_tmp.c_str(), filename.c_str()) != 0) {
+		error("Could not rename file " + filename_tmp + " to " + filename); exit(EXIT_FAILURE);
+	}
+}
+
+void append_segment(const std::string & filename_db, ExperimentId exp_id, const std::string & exp_name, const std::string & exp_desc, ReadCount read_count, const SegmentEntries & entries) {
+	const std::string filename = segment_log_filename(filename_db);
+	std::cerr << getCurrentTime() << " Appending " << entries.size() << " k-mer counts to file " << filename << "\n";
+
+	// the segment is assembled in memory and written with a single call
+	std::vector<char> data;
+	auto put = [&data](const void * p, size_t n) {
+		data.insert(data.end(), static_cast<const char *>(p), static_cast<const char *>(p) + n);
+	};
+	struct HeaderDbSegment hdr_s;
+	put(&hdr_s.label, sizeof(hdr_s.label));
+	put(&hdr_s.size, sizeof(hdr_s.size));
+	put(&exp_id, sizeof(exp_id));
+	put(&read_count, sizeof(read_count));
+	put(exp_name.c_str(), exp_name.length() + 1);
+	put(exp_desc.c_str(), exp_desc.length() + 1);
+	const uint64_t num_entries = entries.size();
+	put(&num_entries, sizeof(num_entries));
+	for(auto const & it : entries) {
+		put(&it.first, sizeof(it.first));
+		put(&it.second, sizeof(it.second));
+	}
+	hdr_s.size = data.size() - sizeof(hdr_s.label) - sizeof(hdr_s.size);
+	memcpy(data.data() + sizeof(hdr_s.label), &hdr_s.size, sizeof(hdr_s.size));
+
+	std::ofstream os(filename, std::ios::out | std::ios::binary | std::ios::app);
+	if(!os.is_open()) {  error("Could not open file " + filename); exit(EXIT_FAILURE); }
+	os.write(data.data(), static_cast<std::streamsize>(data.size()));
 	os.close();
 	if(!os) { // writing failed at some point
-		error("Writing to file " + filename + "failed."); exit(EXIT_FAILURE);
+		error("Writing to file " + filename + " failed."); exit(EXIT_FAILURE);
 	}
 }
 
+/**
+* Adds the segments from the segment log of the database by calling
+* add_posting(index, exp_id, count) for each of their k-mer counts. A
+* truncated segment at the end of the log, e.g. from an interrupted kiq db, is
+* skipped with a warning, since its sample is counted again in append mode.
+*/
+template<typename AddPosting>
+static void read_segments(const std::string & filename_db,
+										KmerIndex n_elem,
+										ExpId2Name & exp_id2name,
+										ExpId2Desc & exp_id2desc,
+										ExpName2Id & exp_name2id,
+										ExpId2ReadCount & exp_id2readcount,
+										AddPosting add_posting) {
 
-void read_database(const std::string & filename,
-										std::vector<Kmer> & initial_kmers,
-										pCountMap * kmer2countmap,
-										boophf_t * bphf,
-										bool append,
+	const std::string filename = segment_log_filename(filename_db);
+	std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+	if(!ifs) return;
+
+	std::cerr << getCurrentTime() << " Reading segments from file " << filename << "\n";
+	// segments that were merged into the database file by an interrupted merge
+	const uint64_t merged_size = merged_segments_size(filename_db);
+	if(merged_size > 0) {
+		std::cerr << "Warning: Skipping segments in file " << filename << ", which are already contained in the database.\n";
+		ifs.seekg(static_cast<std::streamoff>(merged_size));
+	}
+	struct HeaderDbSegment s_ref;
+	std::vector<char> data;
+	size_t num_segments = 0;
+	while(ifs.peek() != EOF) {
+		struct HeaderDbSegment s_in;
+		ifs.read(reinterpret_cast<char*>(&s_in.label), sizeof(s_in.label));
+		ifs.read(reinterpret_cast<char*>(&s_in.size), sizeof(s_in.size));
+		if(ifs.good() && memcmp(s_in.label,s_ref.label,8)!=0) throw std::runtime_error("invalid segment header in file " + filename + ", file corruption detected");
+		if(ifs.good()) {
+			data.resize(s_in.size);
+			ifs.read(data.data(), static_cast<std::streamsize>(s_in.size));
+		}
+		if(!ifs.good()) {
+			std::cerr << "Warning: Skipping incomplete segment at the end of file " << filename << ".\n";
+			break;
+		}
+
+		const char * p = data.data();
+		const char * const end = p + data.size();
+		auto get = [&](void * dst, size_t n) {
+			if(static_cast<size_t>(end - p) < n) throw std::runtime_error("segment #" + std::to_string(num_segments + 1) + " in file " + filename + " is too short, file corruption detected");
+			memcpy(dst, p, n);
+			p += n;
+		};
+		auto get_string = [&]() {
+			const char * const nul = static_cast<const char *>(memchr(p, 0, static_cast<size_t>(end - p)));
+			if(nul == nullptr) throw std::runtime_error("segment #" + std::to_string(num_segments + 1) + " in file " + filename + " is too short, file corruption detected");
+			std::string s(p, nul);
+			p = nul + 1;
+			return s;
+		};
+		ExperimentId exp_id = 0;
+		get(&exp_id, sizeof(exp_id));
+		ReadCount read_count = 0;
+		get(&read_count, sizeof(read_count));
+		const std::string exp_name = get_string();
+		const std::string exp_desc = get_string();
+		uint64_t num_entries = 0;
+		get(&num_entries, sizeof(num_entries));
+		for(uint64_t n = 0; n < num_entries; n++) {
+			KmerIndex index = 0;
+			get(&index, sizeof(index));
+			KmerCount count = 0;
+			get(&count, sizeof(count));
+			if(index >= n_elem) throw std::runtime_error("invalid k-mer index in segment #" + std::to_string(num_segments + 1) + " in file " + filename);
+			add_posting(index, exp_id, count);
+		}
+		if(p != end) throw std::runtime_error("segment #" + std::to_string(num_segments + 1) + " in file " + filename + " has extra bytes, file corruption detected");
+
+		// a sample can be added to an existing experiment, whose name and description are kept
+		if(exp_id2name.count(exp_id) > 0) {
+			exp_id2readcount.at(exp_id) += read_count;
+		}
+		else {
+			exp_id2name.emplace(exp_id,exp_name);
+			exp_id2desc.emplace(exp_id,exp_desc);
+			exp_id2readcount.emplace(exp_id,read_count);
+			exp_name2id.emplace(exp_name,exp_id);
+		}
+		num_segments++;
+	}
+	std::cerr << getCurrentTime() << " Read " << num_segments << " segments\n";
+}
+
+/**
+* Calls f(part) for the parts 0 to num_parts - 1 in one thread each, while
+* meanwhile() runs in the calling thread. An error of a part is thrown as
+* std::runtime_error after all threads have finished.
+*/
+template<typename F, typename G>
+static void run_parts(size_t num_parts, F f, G meanwhile) {
+	std::vector<std::string> errors(num_parts);
+	auto run = [&](size_t part) {
+		try {
+			f(part);
+		}
+		catch(std::exception & e) {
+			errors[part] = e.what();
+		}
+	};
+	std::vector<std::thread> threads;
+	for(size_t part = 0; part < num_parts; part++) threads.push_back(std::thread(run, part));
+	try {
+		meanwhile();
+	}
+	catch(...) {
+		for(auto & t : threads) t.join();
+		throw;
+	}
+	for(auto & t : threads) t.join();
+	for(const std::string & e : errors) {
+		if(!e.empty()) throw std::runtime_error(e);
+	}
+}
+
+// the first of n items in part of num_parts equal parts
+static uint64_t part_begin(uint64_t n, size_t part, size_t num_parts) {
+	return n / num_parts * part + std::min<uint64_t>(part, n % num_parts);
+}
+
+// the records of a version 2 database file are read in chunks of this size
+static const size_t records_chunk_size = 1 << 26;
+
+/**
+* Reads the k-mer records of a database file in version 2 from ifs, which is
+* at the first record, and returns the position of the metadata section in
+* the file. A record consists of the k-mer, its number of experiments and
+* their ids and counts. The file is read in large chunks, and a sequential
+* pass over each chunk finds the record boundaries and splits the complete
+* records into one range for each part. The ranges are parsed in parallel
+* while the next chunk is read, which starts with the incomplete record at
+* the end of the current one.
+*/
+template<typename KmerT, typename AddKmer, typename AddPosting>
+static uint64_t read_records_v2(std::istream & ifs, uint64_t num_kmers, boophf<KmerT> * bphf, size_t num_parts, std::vector<KmerT> & initial_kmers, AddKmer & add_kmer, AddPosting & add_posting) {
+	const size_t record_header_size = sizeof(Kmer) + sizeof(ExperimentCount);
+	const size_t posting_size = sizeof(ExperimentId) + sizeof(KmerCount);
+	initial_kmers.resize(num_kmers);
+
+	std::vector<char> chunk, next_chunk;
+	size_t chunk_size = 0, next_size = 0;
+	// the position of the chunk in the file
+	uint64_t chunk_pos = static_cast<uint64_t>(ifs.tellg());
+	bool eof = false;
+	// reads up to records_chunk_size bytes after the first size bytes of buffer
+	auto fill = [&](std::vector<char> & buffer, size_t & size) {
+		if(buffer.size() < size + records_chunk_size) buffer.resize(size + records_chunk_size);
+		ifs.read(buffer.data() + size, static_cast<std::streamsize>(records_chunk_size));
+		size += static_cast<size_t>(ifs.gcount());
+		if(!ifs.good()) eof = true;
+	};
+	fill(chunk, chunk_size);
+
+	// range p consists of the records from range_start[p] to range_start[p + 1], starting with k-mer range_kmer[p]
+	std::vector<size_t> range_start(num_parts + 1);
+	std::vector<uint64_t> range_kmer(num_parts + 1);
+	uint64_t n = 0;
+	while(n < num_kmers) {
+		size_t pos = 0;
+		uint64_t m = n;
+		size_t next_part = 1;
+		range_start[0] = 0;
+		range_kmer[0] = n;
+		while(m < num_kmers && chunk_size - pos >= record_header_size) {
+			ExperimentCount num_exp = 0;
+			memcpy(&num_exp, chunk.data() + pos + sizeof(Kmer), sizeof(num_exp));
+			const size_t record_size = record_header_size + static_cast<size_t>(num_exp) * posting_size;
+			if(chunk_size - pos < record_size) break;
+			pos += record_size;
+			m++;
+			// each range ends at the first record boundary after its share of the chunk
+			while(next_part < num_parts && pos >= chunk_size / num_parts * next_part) {
+				range_start[next_part] = pos;
+				range_kmer[next_part] = m;
+				next_part++;
+			}
+		}
+		for(; next_part <= num_parts; next_part++) {
+			range_start[next_part] = pos;
+			range_kmer[next_part] = m;
+		}
+		if(m == n) {
+			// the chunk does not hold a complete record
+			if(eof) throw std::runtime_error("could not read k-mer #"+std::to_string(n + 1)+", file truncated");
+			fill(chunk, chunk_size);
+			continue;
+		}
+
+		next_size = chunk_size - pos;
+		if(next_chunk.size() < next_size) next_chunk.resize(next_size);
+		memcpy(next_chunk.data(), chunk.data() + pos, next_size);
+		run_parts(num_parts, [&](size_t part) {
+			const char * r = chunk.data() + range_start[part];
+			for(uint64_t k = range_kmer[part]; k < range_kmer[part + 1]; k++) {
+				Kmer kmer = 0;
+				memcpy(&kmer, r, sizeof(kmer));
+				ExperimentCount num_exp = 0;
+				memcpy(&num_exp, r + sizeof(Kmer), sizeof(num_exp));
+				r += record_header_size;
+				const KmerIndex index = bphf->lookup(kmer);
+				if(index >= bphf->nbKeys()) throw std::runtime_error("k-mer #"+std::to_string(k + 1)+" is not in the index, file corruption detected");
+				initial_kmers[k] = kmer;
+				add_kmer(part, index, num_exp);
+				for(ExperimentCount i = 0; i < num_exp; i++) {
+					ExperimentId exp_id = 0;
+					memcpy(&exp_id, r, sizeof(exp_id));
+					KmerCount count = 0;
+					memcpy(&count, r + sizeof(exp_id), sizeof(count));
+					r += posting_size;
+					add_posting(part, index, exp_id, count);
+				}
+			}
+		}, [&]() {
+			if(m < num_kmers && !eof) fill(next_chunk, next_size);
+		});
+		n = m;
+		chunk_pos += pos;
+		std::swap(chunk, next_chunk);
+		std::swap(chunk_size, next_size);
+	}
+	return chunk_pos;
+}
+
+/**
+* Reads the database file without its segments, split into num_parts parts
+* of k-mers that are read in parallel. For each k-mer of a part, in the order
+* of the file, add_kmer(part, index, num_exp) is called, followed by
+* add_posting(part, index, exp_id, count) for each of its num_exp
+* experiments. Calls for different parts are concurrent and for different
+* k-mers.
+*/
+template<typename KmerT, typename AddKmer, typename AddPosting>
+static void read_database_file(const std::string & filename,
+										std::vector<KmerT> & initial_kmers,
+										boophf<KmerT> * bphf,
 										ExpId2Name & exp_id2name,
 										ExpId2Desc & exp_id2desc,
 										ExpName2Id & exp_name2id,
-										ExpId2ReadCount & exp_id2readcount) {
+										ExpId2ReadCount & exp_id2readcount,
+										size_t num_parts,
+										AddKmer add_kmer,
+										AddPosting add_posting) {
 
 	std::cerr << getCurrentTime() << " Reading database file " << filename << "\n";
 	std::ifstream ifs(filename, std::ios::in | std::ios::binary);
 	if(!ifs) {  error("Could not open file " + filename); exit(EXIT_FAILURE); }
+	num_parts = std::max(num_parts, static_cast<size_t>(1));
+
+	const HeaderDbFile h_in = read_database_header(ifs);
+	if(h_in.dbVer >= DB_VERSION_OFFSETS) {
+		ifs.close();
+		const DatabaseFile<KmerT> file(filename, h_in, bphf, false);
+		initial_kmers.assign(file.kmers, file.kmers + file.num_kmers);
+		run_parts(num_parts, [&](size_t part) {
+			std::vector<ExperimentId> exp_ids;
+			std::vector<KmerCount> counts;
+			const KmerIndex end = part_begin(file.num_kmers, part + 1, num_parts);
+			for(KmerIndex index = part_begin(file.num_kmers, part, num_parts); index < end; index++) {
+				const uint64_t offset = file.offsets[index];
+				const uint64_t next_offset = file.offsets[index + 1];
+				if(next_offset < offset || next_offset > file.num_postings) throw std::runtime_error("invalid offset of k-mer index "+std::to_string(index + 1)+", file corruption detected");
+				if(file.encoded != nullptr) {
+					const uint8_t * list = file.encoded + offset;
+					const size_t size = next_offset - offset;
+					ExperimentCount num_exp = 0;
+					if(!decode_num_postings(list, size, num_exp)) throw std::runtime_error("invalid postings of k-mer index "+std::to_string(index)+", file corruption detected");
+					exp_ids.resize(decode_capacity(num_exp));
+					counts.resize(decode_capacity(num_exp));
+					if(!decode_postings(list, size, exp_ids.data(), counts.data())) throw std::runtime_error("invalid postings of k-mer index "+std::to_string(index)+", file corruption detected");
+					add_kmer(part, index, num_exp);
+					for(ExperimentCount i = 0; i < num_exp; i++) {
+						add_posting(part, index, exp_ids[i], counts[i]);
+					}
+				}
+				else {
+					if(next_offset - offset > std::numeric_limits<ExperimentCount>::max()) throw std::runtime_error("invalid offset of k-mer index "+std::to_string(index + 1)+", file corruption detected");
+					const ExperimentCount num_exp = static_cast<ExperimentCount>(next_offset - offset);
+					add_kmer(part, index, num_exp);
+					for(uint64_t p = offset; p < next_offset; p++) {
+						add_posting(part, index, file.exp_ids[p], file.counts[p]);
+					}
+				}
+			}
+		}, [](){});
+		file.readMetadata(exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+	}
+	else {
+		// the k-mers of version 2 are stored in 64 bit
+		if(sizeof(KmerT) != sizeof(Kmer)) throw std::runtime_error("Mismatching k-mer length in hash index and k-mer database");
+		// read k-mer section
+		struct HeaderDbKmers k;
+		ifs.read(reinterpret_cast<char*>(&k.numKmer), sizeof(k.numKmer));
+		if(!ifs.good()) throw std::runtime_error("could not read number of kmers, file truncated");
+		if(k.numKmer != bphf->nbKeys()) throw std::runtime_error("Mismatching number of k-mers in hash index and k-mer database");
 
-	//read header
+		const uint64_t metadata_pos = read_records_v2(ifs, k.numKmer, bphf, num_parts, initial_kmers, add_kmer, add_posting);
+		// the last chunk may have been read beyond the records
+		ifs.clear();
+		ifs.seekg(static_cast<std::streamoff>(metadata_pos));
+		read_metadata(ifs, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount);
+	}
+}
+
+
+HeaderDbFile read_database_header(std::istream & ifs) {
 	struct HeaderDbFile h_in;
 	struct HeaderDbFile h_ref;
 	ifs.read(reinterpret_cast<char*>(&h_in.magic), sizeof(h_in.magic));
@@ -121,36 +669,27 @@ void read_database(const std::string & filename,
 
 	ifs.read(reinterpret_cast<char*>(&h_in.dbVer), sizeof(h_in.dbVer));
 	if(!ifs.good())  throw std::runtime_error("could not read version, file truncated");
-
-	// read k-mer section
-	struct HeaderDbKmers k;
-	ifs.read(reinterpret_cast<char*>(&k.numKmer), sizeof(k.numKmer));
-	if(!ifs.good()) throw std::runtime_error("could not read number of kmers, file truncated");
-	if(k.numKmer != bphf->nbKeys()) throw std::runtime_error("Mismatching number of k-mers in hash index and k-mer database");
-
-	for(uint64_t n = 1; n <= k.numKmer; n++) {
-		Kmer kmer;
-		ifs.read(reinterpret_cast<char*>(&kmer), sizeof(Kmer));
-		if(!ifs.good()) throw std::runtime_error("could not read k-mer #"+std::to_string(n)+", file truncated");
-		KmerIndex index = bphf->lookup(kmer);
-		assert(index < bphf->nbKeys());
-		initial_kmers.emplace_back(kmer);
-		ExperimentCount num_exp = 0;
-		ifs.read(reinterpret_cast<char*>(&num_exp), sizeof(ExperimentCount));
-		if(!ifs.good()) throw std::runtime_error("could not read experiment count for k-mer "+std::to_string(kmer)+", file truncated");
-		if(num_exp>0) {
-			if(append) kmer2countmap[index] = new CountMap();
-			for(int i=0; i < static_cast<int>(num_exp); i++) {
-				ExperimentId exp_id = 0;
-				ifs.read(reinterpret_cast<char*>(&exp_id), sizeof(ExperimentId));
-				if(!ifs.good()) throw std::runtime_error("could not read experiment id for k-mer "+std::to_string(kmer)+", file truncated");
-				KmerCount count = 0;
-				ifs.read(reinterpret_cast<char*>(&count), sizeof(KmerCount));
-				if(!ifs.good()) throw std::runtime_error("could not read k-mer count for experiment id "+std::to_string(exp_id)+", file truncated");
-				if(append) kmer2countmap[index]->emplace(exp_id,count);
-			}
+	if(h_in.dbVer >= DB_VERSION_FLAGS) {
+		ifs.read(reinterpret_cast<char*>(&h_in.flags), sizeof(h_in.flags));
+		ifs.read(reinterpret_cast<char*>(&h_in.k), sizeof(h_in.k));
+		if(!ifs.good())  throw std::runtime_error("could not read flags, file truncated");
+		if(h_in.flags & ~(DB_FLAG_COMPRESSED | DB_FLAG_BLOCKS | DB_FLAG_MERGED_LOG)) throw std::runtime_error("unsupported flags in database file");
+		if(h_in.flags & DB_FLAG_MERGED_LOG) {
+			ifs.read(reinterpret_cast<char*>(&h_in.mergedLogSize), sizeof(h_in.mergedLogSize));
+			ifs.read(reinterpret_cast<char*>(&h_in.mergedLogCrc), sizeof(h_in.mergedLogCrc));
+			ifs.read(reinterpret_cast<char*>(&h_in.padding), sizeof(h_in.padding));
+			if(!ifs.good())  throw std::runtime_error("could not read merged segments, file truncated");
 		}
 	}
+	return h_in;
+}
+
+
+void read_metadata(std::istream & ifs,
+										ExpId2Name & exp_id2name,
+										ExpId2Desc & exp_id2desc,
+										ExpName2Id & exp_name2id,
+										ExpId2ReadCount & exp_id2readcount) {
 
 	// read metadata section
 	struct HeaderDbMetadata m_in;
@@ -186,15 +725,224 @@ void read_database(const std::string & filename,
 	}
 	// there should be nothing else left after this point
 	if(ifs.peek() != EOF)  throw std::runtime_error("file has extra bytes, file corruption detected");
+}
+
+
+template<typename KmerT>
+void read_database(const std::string & filename,
+										std::vector<KmerT> & initial_kmers,
+										IngestPostings & kmer2postings,
+										boophf<KmerT> * bphf,
+										bool append,
+										ExpId2Name & exp_id2name,
+										ExpId2Desc & exp_id2desc,
+										ExpName2Id & exp_name2id,
+										ExpId2ReadCount & exp_id2readcount) {
+
+	// the counts are only needed when appending to the database, each part
+	// adds them to its own arena
+	auto add_kmer = [&](size_t part, KmerIndex index, ExperimentCount num_exp) {
+		if(append && num_exp > 0) kmer2postings.reserve(index, num_exp, part);
+	};
+	auto add_posting = [&](size_t part, KmerIndex index, ExperimentId exp_id, KmerCount count) {
+		if(append) kmer2postings.add(index, exp_id, count, part);
+	};
+	read_database_file(filename, initial_kmers, bphf, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount, kmer2postings.numArenas(), add_kmer, add_posting);
+
+	read_segments(filename, (KmerIndex)bphf->nbKeys(), exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount, [&](KmerIndex index, ExperimentId exp_id, KmerCount count) {
+		if(append) kmer2postings.add(index, exp_id, count);
+	});
 
 }
 
 
-void load_index(const std::string & filename_index,  boophf_t * bphf) {
+/**
+* The k-mers are stored in sorted order in the database file, therefore their
+* postings are collected in this order by each part of the file first and
+* then moved to the order of the MPHF indices, by all parts in parallel. The
+* postings from the segment log are merged in afterwards.
+*/
+template<typename KmerT>
+void read_database(const std::string & filename,
+										std::vector<KmerT> & initial_kmers,
+										KmerPostings & postings,
+										boophf<KmerT> * bphf,
+										ExpId2Name & exp_id2name,
+										ExpId2Desc & exp_id2desc,
+										ExpName2Id & exp_name2id,
+										ExpId2ReadCount & exp_id2readcount) {
+
+	const KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
+	// offsets[index + 1] holds the number of postings of the k-mer until the prefix sum is taken
+	postings.offsets.assign(n_elem + 1, 0);
+	// the k-mers and postings of each part in the order of the file
+	struct Part {
+		std::vector<KmerIndex> file_order;
+		std::vector<ExperimentId> exp_ids;
+		std::vector<KmerCount> counts;
+	};
+	const size_t num_parts = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::unique_ptr<Part>> parts;
+	for(size_t part = 0; part < num_parts; part++) parts.emplace_back(new Part());
+	auto add_kmer = [&](size_t part, KmerIndex index, ExperimentCount num_exp) {
+		parts[part]->file_order.push_back(index);
+		postings.offsets[index + 1] = num_exp;
+	};
+	auto add_posting = [&](size_t part, KmerIndex, ExperimentId exp_id, KmerCount count) {
+		parts[part]->exp_ids.push_back(exp_id);
+		parts[part]->counts.push_back(count);
+	};
+	read_database_file(filename, initial_kmers, bphf, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount, num_parts, add_kmer, add_posting);
+
+	for(KmerIndex i = 0; i < n_elem; i++) {
+		postings.offsets[i + 1] += postings.offsets[i];
+	}
+	postings.exp_ids.resize(postings.offsets[n_elem]);
+	postings.counts.resize(postings.offsets[n_elem]);
+	run_parts(num_parts, [&](size_t part) {
+		Part & p = *parts[part];
+		uint64_t from = 0;
+		for(KmerIndex index : p.file_order) {
+			const uint64_t to = postings.offsets[index];
+			const uint64_t n = postings.offsets[index + 1] - to;
+			std::copy(p.exp_ids.begin() + from, p.exp_ids.begin() + from + n, postings.exp_ids.begin() + to);
+			std::copy(p.counts.begin() + from, p.counts.begin() + from + n, postings.counts.begin() + to);
+			from += n;
+		}
+		parts[part].reset();
+	}, [](){});
+
+	std::vector<SegmentPosting> added;
+	read_segments(filename, n_elem, exp_id2name, exp_id2desc, exp_name2id, exp_id2readcount, [&](KmerIndex index, ExperimentId exp_id, KmerCount count) {
+		added.push_back(SegmentPosting{index, exp_id, count});
+	});
+	if(!added.empty()) postings.merge(added);
+
+}
+
+
+void KmerPostings::merge(std::vector<SegmentPosting> & added) {
+	std::sort(added.begin(), added.end(), [](const SegmentPosting & a, const SegmentPosting & b) {
+		return a.index < b.index || (a.index == b.index && a.exp_id < b.exp_id);
+	});
+	const KmerIndex n_elem = offsets.size() - 1;
+	std::vector<uint64_t> new_offsets(n_elem + 1, 0);
+	std::vector<ExperimentId> new_exp_ids;
+	std::vector<KmerCount> new_counts;
+	new_exp_ids.reserve(exp_ids.size() + added.size());
+	new_counts.reserve(counts.size() + added.size());
+	auto a = added.begin();
+	for(KmerIndex i = 0; i < n_elem; i++) {
+		uint64_t p = offsets[i];
+		while(p < offsets[i + 1] || (a != added.end() && a->index == i)) {
+			// merge the sorted postings of the k-mer with the added ones
+			const bool take_added = a != added.end() && a->index == i && (p == offsets[i + 1] || a->exp_id <= exp_ids[p]);
+			const ExperimentId exp_id = take_added ? a->exp_id : exp_ids[p];
+			KmerCount count = 0;
+			if(take_added) { count = a->count; ++a; }
+			else { count = counts[p]; p++; }
+			if(new_offsets[i] < new_exp_ids.size() && new_exp_ids.back() == exp_id) {
+				new_counts.back() += count;
+			}
+			else {
+				new_exp_ids.push_back(exp_id);
+				new_counts.push_back(count);
+			}
+		}
+		new_offsets[i + 1] = new_exp_ids.size();
+	}
+	offsets.swap(new_offsets);
+	exp_ids.swap(new_exp_ids);
+	counts.swap(new_counts);
+}
+
+void KmerPostings::removeExperiments(const std::set<ExperimentId> & removed) {
+	// the postings are moved towards the front within the arrays
+	const KmerIndex n_elem = offsets.size() - 1;
+	uint64_t to = 0;
+	uint64_t from = offsets[0];
+	for(KmerIndex i = 0; i < n_elem; i++) {
+		const uint64_t end = offsets[i + 1];
+		offsets[i] = to;
+		for(uint64_t p = from; p < end; p++) {
+			if(removed.count(exp_ids[p]) > 0) continue;
+			exp_ids[to] = exp_ids[p];
+			counts[to] = counts[p];
+			to++;
+		}
+		from = end;
+	}
+	offsets[n_elem] = to;
+	exp_ids.resize(to);
+	counts.resize(to);
+}
+
+
+// reads the header of the index file from ifs, which is then at the MPHF
+static HeaderIndexFile read_index_header(std::istream & ifs, const std::string & filename_index) {
+	HeaderIndexFile header;
+	uint8_t magic[4];
+	ifs.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+	if(ifs.gcount() == sizeof(magic) && memcmp(magic, header.magic, sizeof(magic)) == 0) {
+		ifs.read(reinterpret_cast<char *>(&header.indexVer), sizeof(header.indexVer));
+		ifs.read(reinterpret_cast<char *>(&header.flags), sizeof(header.flags));
+		ifs.read(reinterpret_cast<char *>(&header.k), sizeof(header.k));
+		if(!ifs.good() || header.indexVer != 1) { error("Unsupported version of index file " + filename_index); exit(EXIT_FAILURE); }
+		if(header.k == 0 || header.k > MAX_K) { error("Index file " + filename_index + " has k=" + std::to_string(header.k) + ", but only k<=" + std::to_string(MAX_K) + " is supported"); exit(EXIT_FAILURE); }
+	}
+	else {
+		// old index file without header
+		ifs.clear();
+		ifs.seekg(0);
+	}
+	return header;
+}
+
+HeaderIndexFile load_index_header(const std::string & filename_index) {
+	std::ifstream ifs(filename_index, std::ios::binary);
+	if(!ifs.is_open()) { std::cerr << "Cannot open file " << filename_index << std::endl; exit(EXIT_FAILURE); }
+	return read_index_header(ifs, filename_index);
+}
+
+template<typename KmerT>
+HeaderIndexFile load_index(const std::string & filename_index, boophf<KmerT> * bphf) {
 	std::cerr << getCurrentTime() << " Reading index from file " << filename_index << "\n";
 	std::ifstream ifs(filename_index, std::ios::binary);
 	if(!ifs.is_open()) { std::cerr << "Cannot open file " << filename_index << std::endl; exit(EXIT_FAILURE); }
+	const HeaderIndexFile header = read_index_header(ifs, filename_index);
+	assert((header.k > MAX_K_64) == (sizeof(KmerT) > sizeof(Kmer)));
 	bphf->load(ifs);
+	if(header.flags & INDEX_FLAG_CANONICAL) std::cerr << getCurrentTime() << " Index contains canonical k-mers\n";
+	return header;
+}
+
+template<typename KmerT>
+void save_index(const std::string & filename_index, boophf<KmerT> * bphf, const HeaderIndexFile & header) {
+	std::cerr << getCurrentTime() << " Writing index to file " << filename_index << "\n";
+	std::ofstream os(filename_index, std::ofstream::out | std::ofstream::binary);
+	if(!os.is_open()) { error("Could not open file " + filename_index); exit(EXIT_FAILURE); }
+	os.write(reinterpret_cast<const char *>(&header.magic), sizeof(header.magic));
+	os.write(reinterpret_cast<const char *>(&header.indexVer), sizeof(header.indexVer));
+	os.write(reinterpret_cast<const char *>(&header.flags), sizeof(header.flags));
+	os.write(reinterpret_cast<const char *>(&header.k), sizeof(header.k));
+	bphf->save(os);
+	if(!os.good()) { error("Could not write file " + filename_index); exit(EXIT_FAILURE); }
+	os.close();
+}
+
+/**
+* Stores each k-mer at the position given by its MPHF index, so that a hit of
+* an arbitrary k-mer in bphf->lookup() can be verified by a single array access.
+*/
+template<typename KmerT>
+void fill_index2kmer(const std::vector<KmerT> & initial_kmers, boophf<KmerT> * bphf, std::vector<KmerT> & index2kmer) {
+	const KmerIndex n_elem = (KmerIndex)bphf->nbKeys();
+	index2kmer.assign(n_elem, 0);
+	for(KmerT kmer : initial_kmers) {
+		KmerIndex index = bphf->lookup(kmer);
+		assert(index < n_elem);
+		index2kmer[index] = kmer;
+	}
 }
 
 
@@ -224,12 +972,13 @@ std::string getCurrentTime() {
 }
 
 /**
-* Converts a string of "ATCG" to a uint64_t
+* Converts a string of "ATCG" to a Kmer or Kmer128
 * where each character is represented by using only two bits
 * from https://github.com/splatlab/squeakr/blob/master/kmer.h
 */
-Kmer str_to_int(const std::string & str) {
-	uint64_t strint = 0;
+template<typename KmerT>
+KmerT str_to_int(const std::string & str) {
+	KmerT strint = 0;
 	for(auto it : str) {
 		strint <<= 2;
 		uint8_t curr = DNA_MAP::A;
@@ -241,23 +990,24 @@ Kmer str_to_int(const std::string & str) {
 			case 'c': { curr = DNA_MAP::C; break; }
 			case 'G': { curr = DNA_MAP::G; break; }
 			case 'g': { curr = DNA_MAP::G; break; }
-			// TODO right now all non-CGT chars are used as A
+			// all non-CGT chars are used as A, therefore check strings with is_dna() first
 		}
 		strint = strint | curr;
 	}
-	return (Kmer)strint;
+	return strint;
 }
 
 /**
-* Converts a uint64_t to a string of "ACTG"
+* Converts a Kmer or Kmer128 holding a k-mer of length k to a string of "ACTG"
 * where each character is represented by using only two bits
 * from https://github.com/splatlab/squeakr/blob/master/kmer.h
 */
-std::string int_to_str(const Kmer kmer) {
+template<typename KmerT>
+std::string int_to_str(const KmerT kmer, unsigned k) {
 	uint8_t base;
 	std::string str;
-	for(int i=KMER_K; i>0; i--) {
-		base = (kmer >> (i*2-2)) & 3ULL;
+	for(int i=static_cast<int>(k); i>0; i--) {
+		base = static_cast<uint8_t>((kmer >> (i*2-2)) & 3U);
 		char chr = 'A';
 		switch(base) {
 			//	case DNA_MAP::A: { return 'A'; }
@@ -274,19 +1024,31 @@ void error(const std::string e) {
 	std::cerr << "Error: " << e << std::endl << std::endl;
 }
 
-
-inline bool isalpha(const char & c) {
-	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-}
-
-
-void strip(std::string & s) {
-		for(auto it = s.begin(); it!=s.end(); ++it) {
-			if(!isalpha(*it)) {
-				s.erase(it);
-				it--;
-			}
+bool is_dna(const std::string & s) {
+	for(const char c : s) {
+		switch(c) {
+			case 'A': case 'C': case 'G': case 'T':
+			case 'a': case 'c': case 'g': case 't':
+				break;
+			default:
+				return false;
 		}
+	}
+	return true;
 }
 
+// the functions for both k-mer types
+#define INSTANTIATE_KMER_FUNCTIONS(KmerT) \
+	template KmerT str_to_int<KmerT>(const std::string &); \
+	template std::string int_to_str<KmerT>(KmerT, unsigned); \
+	template HeaderIndexFile load_index<KmerT>(const std::string &, boophf<KmerT> *); \
+	template void save_index<KmerT>(const std::string &, boophf<KmerT> *, const HeaderIndexFile &); \
+	template void fill_index2kmer<KmerT>(const std::vector<KmerT> &, boophf<KmerT> *, std::vector<KmerT> &); \
+	template void read_database<KmerT>(const std::string &, std::vector<KmerT> &, IngestPostings &, boophf<KmerT> *, bool, ExpId2Name &, ExpId2Desc &, ExpName2Id &, ExpId2ReadCount &); \
+	template void read_database<KmerT>(const std::string &, std::vector<KmerT> &, KmerPostings &, boophf<KmerT> *, ExpId2Name &, ExpId2Desc &, ExpName2Id &, ExpId2ReadCount &); \
+	template void write_database<KmerT>(const std::string &, const std::vector<KmerT> &, const IngestPostings &, boophf<KmerT> *, const ExpId2Name &, const ExpId2Desc &, const ExpId2ReadCount &, unsigned, uint32_t); \
+	template void write_database<KmerT>(const std::string &, const std::vector<KmerT> &, const KmerPostings &, boophf<KmerT> *, const ExpId2Name &, const ExpId2Desc &, const ExpId2ReadCount &, unsigned, uint32_t); \
+	template void write_initial_database<KmerT>(const std::string &, const std::vector<KmerT> &, unsigned, uint32_t);
 
+INSTANTIATE_KMER_FUNCTIONS(Kmer)
+INSTANTIATE_KMER_FUNCTIONS(Kmer128)
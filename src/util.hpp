@@ -7,22 +7,26 @@
 #include <time.h>
 #include <map>
 #include <fstream>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 
 #include "BooPHF/BooPHF.h"
 #include "version.hpp"
 
-using hasher_t = boomphf::SingleHashFunctor<u_int64_t>;
-using boophf_t = boomphf::mphf<u_int64_t, hasher_t>;
+// k-mers of up to MAX_K_64 bases are stored in 64 bit (Kmer), longer ones in 128 bit (Kmer128)
+const uint32_t MAX_K = 64;
+const uint32_t MAX_K_64 = 32;
 
 using ExperimentId = uint32_t;
 using ExperimentCount = uint32_t;
 using KmerCount = uint32_t;
 using KmerIndex = uint64_t;
 using Kmer = uint64_t;
+__extension__ typedef unsigned __int128 Kmer128;
 using ReadCount = uint64_t;
 
-using CountMap = std::map<ExperimentId, KmerCount>;
-using pCountMap = CountMap*;
 using ExpId2Name = std::map<ExperimentId, std::string>;
 using ExpId2Desc = std::map<ExperimentId, std::string>;
 using ExpName2Id = std::map<std::string, ExperimentId>;
@@ -30,9 +34,102 @@ using ExpId2ReadCount = std::map<ExperimentId, ReadCount>;
 
 enum DNA_MAP {C, A, T, G};  // A=1, C=0, T=2, G=3
 
+/**
+* Hash function of BBHash for 128 bit k-mers. The hash functions of BBHash
+* only use the lower 64 bits of a key, therefore the lower half is hashed
+* with the hash of the upper half as seed.
+*/
+struct Kmer128Hasher {
+	boomphf::SingleHashFunctor<u_int64_t> hasher;
+
+	uint64_t operator()(const Kmer128 & key, uint64_t seed = 0xAAAAAAAA55555555ULL) const {
+		return hasher(static_cast<uint64_t>(key), hasher(static_cast<uint64_t>(key >> 64), seed));
+	}
+};
+
+// the hash function of BBHash for k-mers of type KmerT
+template<typename KmerT> struct KmerHasher { using type = boomphf::SingleHashFunctor<KmerT>; };
+template<> struct KmerHasher<Kmer128> { using type = Kmer128Hasher; };
+
+// the MPHF of an index with k-mers of type KmerT
+template<typename KmerT> using boophf = boomphf::mphf<KmerT, typename KmerHasher<KmerT>::type>;
+
+/**
+* Header of the index file, which is followed by the MPHF.
+* Index files written before the header was introduced start directly with
+* the MPHF and are read as non-canonical indexes with k = 32.
+* The MPHF of an index with k > MAX_K_64 is built over 128 bit k-mers.
+*/
+struct HeaderIndexFile {
+    uint8_t magic[4] = {'K','I','Q','I'};
+    uint32_t indexVer = 1;
+    uint32_t flags = 0;
+    uint32_t k = MAX_K_64;
+};
+
+// the index contains only canonical k-mers, i.e. the smaller of each k-mer and its reverse complement
+const uint32_t INDEX_FLAG_CANONICAL = 1;
+
+/**
+* Version 2 of the database file lists each k-mer followed by its number of
+* experiments and their ids and counts. Version 3 contains all k-mers, then
+* the offsets of their postings indexed by MPHF index (one more than the
+* number of k-mers), then the experiment ids and then the counts of all
+* postings in this order, so that the postings of a k-mer can be accessed
+* directly in the memory-mapped file. Both end with the metadata section.
+* Version 4 adds flags and k after the version, where k is 0 in files written
+* before it was stored. With k > MAX_K_64, the k-mers take 16 bytes each and
+* 8 bytes of padding after the number of k-mers align them to 16 bytes in the
+* file. With DB_FLAG_COMPRESSED, the offsets are byte offsets into one section
+* of compressed posting lists instead of the experiment ids and counts, see
+* PostingCodec.hpp. With DB_FLAG_BLOCKS, everything after the header is
+* compressed in blocks, see DbBlock. With DB_FLAG_MERGED_LOG, the header
+* continues with the size and CRC-32 of the segments at the beginning of the
+* segment log that are contained in the file, see HeaderDbSegment.
+*/
 struct HeaderDbFile {
     uint8_t magic[4] = {'K','I','Q',0x0A}; // == KIQ\n
-    uint32_t dbVer = 2;
+    uint32_t dbVer = 4;
+    uint32_t flags = 0;
+    uint32_t k = 0; // also aligns the k-mers and offsets to 8 bytes in the file
+    // only in the file with DB_FLAG_MERGED_LOG
+    uint64_t mergedLogSize = 0;
+    uint32_t mergedLogCrc = 0;
+    uint32_t padding = 0;
+};
+
+// the first version with the offset table
+const uint32_t DB_VERSION_OFFSETS = 3;
+// the first version with flags
+const uint32_t DB_VERSION_FLAGS = 4;
+
+// the posting lists are compressed
+const uint32_t DB_FLAG_COMPRESSED = 1;
+// the file is compressed in blocks
+const uint32_t DB_FLAG_BLOCKS = 2;
+// the file contains the segments at the beginning of the segment log
+const uint32_t DB_FLAG_MERGED_LOG = 4;
+
+/**
+* The content of a database file with DB_FLAG_BLOCKS after the header is
+* split into blocks of DB_BLOCK_SIZE bytes, except for the last one, which
+* are compressed independently as raw deflate data, so that they can be
+* compressed and decompressed in parallel. The compressed blocks follow the
+* header and are followed by the block index, which holds a DbBlock for each
+* of them, and the trailer TrailerDbBlocks at the end of the file.
+*/
+const size_t DB_BLOCK_SIZE = 1 << 22;
+
+struct DbBlock {
+    uint32_t compressedSize = 0;
+    uint32_t size = 0;
+    uint32_t crc = 0; // CRC-32 of the uncompressed block
+};
+
+struct TrailerDbBlocks {
+    uint64_t numBlocks = 0;
+    uint64_t size = 0; // the sum of the uncompressed block sizes
+    uint8_t label[8] = {'B','L','O','C','K','I','D','X'};
 };
 
 struct HeaderDbKmers {
@@ -44,44 +141,195 @@ struct HeaderDbMetadata {
     uint64_t numExp = 0;
 };
 
+/**
+* Samples added by kiq db and kiq sra are appended as segments to the segment
+* log of the database, instead of rewriting the whole database file for each
+* sample. A segment consists of this header, the size of the following data,
+* and then the experiment id, read count, name and description of the sample,
+* the number of k-mers with counts > 0, and for each of these its index in
+* the MPHF and its count. read_database() adds the segments to the content of
+* the database file and write_database() merges them into it. The database
+* file is replaced before the log is removed, therefore its header records
+* the merged segments, which are skipped if the log is still there.
+*/
+struct HeaderDbSegment {
+    uint8_t label[8] = {'S','E','G','M','E','N','T',0x0A};
+    uint64_t size = 0;
+};
 
+using SegmentEntries = std::vector<std::pair<KmerIndex, KmerCount>>;
 
-#define KMER_K 32
+// postings of the commands that add samples to the database, see IngestPostings.hpp
+class IngestPostings;
 
-void error(const std::string e);
+// a k-mer count of a sample from the segment log
+struct SegmentPosting {
+	KmerIndex index;
+	ExperimentId exp_id;
+	KmerCount count;
+};
+
+/**
+* Experiment ids and counts of all k-mers in compressed sparse row layout,
+* which is used by the commands that only read the database. The postings of
+* the k-mer with MPHF index i are at the positions offsets[i] to
+* offsets[i + 1] - 1 of exp_ids and counts, sorted by experiment id.
+*/
+struct KmerPostings {
+	std::vector<uint64_t> offsets;
+	std::vector<ExperimentId> exp_ids;
+	std::vector<KmerCount> counts;
+
+	ExperimentCount numExperiments(KmerIndex index) const { return static_cast<ExperimentCount>(offsets[index + 1] - offsets[index]); }
+	// adds the postings, summing up the counts of experiments that are already present for a k-mer
+	void merge(std::vector<SegmentPosting> & added);
+	// removes the postings of the experiments
+	void removeExperiments(const std::set<ExperimentId> & removed);
+};
 
-void strip(std::string &s);
 
-bool isalpha(const char & c);
+/**
+* Accumulates the time that a thread spends waiting for other stages of the
+* processing pipeline.
+*/
+class StallTimer {
+	private:
+		// atomic, so that the time can be read while another thread uses the timer
+		std::atomic<std::chrono::steady_clock::rep> total{0};
+		std::chrono::steady_clock::time_point start_time;
+
+	public:
+		void start() { start_time = std::chrono::steady_clock::now(); }
+		void stop() { total.fetch_add((std::chrono::steady_clock::now() - start_time).count(), std::memory_order_relaxed); }
+		double seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::duration(total.load(std::memory_order_relaxed))).count(); }
+};
+
+void error(const std::string e);
+
+// checks that the string consists only of the characters ACGT/acgt
+bool is_dna(const std::string & s);
 
 void print_usage_header();
 
 std::string getCurrentTime();
 
-Kmer str_to_int(const std::string & str);
-std::string int_to_str(Kmer kmer);
+template<typename KmerT> KmerT str_to_int(const std::string & str);
+template<typename KmerT> std::string int_to_str(KmerT kmer, unsigned k);
+
+// the lower 2 * k bits, which hold a k-mer
+template<typename KmerT>
+inline KmerT kmer_mask(unsigned k) {
+	return ~static_cast<KmerT>(0) >> (8 * sizeof(KmerT) - 2 * k);
+}
 
-void load_index(const std::string & filename_index,  boophf_t * bphf);
+// reverses the order of the 32 bases in the word and complements A/T and C/G in DNA_MAP
+inline uint64_t reverse_complement_bases(uint64_t w) {
+	w = ~w;
+	w = ((w >> 2) & 0x3333333333333333ULL) | ((w & 0x3333333333333333ULL) << 2);
+	w = ((w >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((w & 0x0F0F0F0F0F0F0F0FULL) << 4);
+	return __builtin_bswap64(w);
+}
 
+inline Kmer reverse_complement(Kmer kmer, unsigned k) {
+	return reverse_complement_bases(kmer) >> (64 - 2 * k);
+}
+
+inline Kmer128 reverse_complement(Kmer128 kmer, unsigned k) {
+	const Kmer128 rc = static_cast<Kmer128>(reverse_complement_bases(static_cast<uint64_t>(kmer))) << 64 | reverse_complement_bases(static_cast<uint64_t>(kmer >> 64));
+	return rc >> (128 - 2 * k);
+}
+
+template<typename KmerT>
+inline KmerT canonical_kmer(KmerT kmer, unsigned k) {
+	return std::min(kmer, reverse_complement(kmer, k));
+}
+
+// returns the header of the index file, which is also filled for old files without header
+HeaderIndexFile load_index_header(const std::string & filename_index);
+// also loads the MPHF, whose k-mer type must match k of the index
+template<typename KmerT> HeaderIndexFile load_index(const std::string & filename_index, boophf<KmerT> * bphf);
+template<typename KmerT> void save_index(const std::string & filename_index, boophf<KmerT> * bphf, const HeaderIndexFile & header);
+
+template<typename KmerT> void fill_index2kmer(const std::vector<KmerT> & initial_kmers, boophf<KmerT> * bphf, std::vector<KmerT> & index2kmer);
+
+template<typename KmerT>
 void read_database(const std::string & filename,
-										std::vector<Kmer> & initial_kmers,
-										pCountMap * kmer2countmap,
-										boophf_t * bphf,
+										std::vector<KmerT> & initial_kmers,
+										IngestPostings & kmer2postings,
+										boophf<KmerT> * bphf,
 										bool append,
 										ExpId2Name & exp_id2name,
 										ExpId2Desc & exp_id2desc,
 										ExpName2Id & exp_name2id,
 										ExpId2ReadCount & exp_id2readcount);
 
+// reads the database into postings, always including the counts
+template<typename KmerT>
+void read_database(const std::string & filename,
+										std::vector<KmerT> & initial_kmers,
+										KmerPostings & postings,
+										boophf<KmerT> * bphf,
+										ExpId2Name & exp_id2name,
+										ExpId2Desc & exp_id2desc,
+										ExpName2Id & exp_name2id,
+										ExpId2ReadCount & exp_id2readcount);
+
+// k is stored in the header of the database file
+template<typename KmerT>
+void write_database(const std::string & filename,
+										const std::vector<KmerT> & initial_kmers,
+										const IngestPostings & kmer2postings,
+										boophf<KmerT> * bphf,
+										const ExpId2Name & exp_id2name,
+										const ExpId2Desc & exp_id2desc,
+										const ExpId2ReadCount & exp_id2readcount,
+										unsigned k,
+										uint32_t flags);
+
+template<typename KmerT>
 void write_database(const std::string & filename,
-										const std::vector<Kmer> & initial_kmers,
-										pCountMap * kmer2countmap,
-										boophf_t * bphf,
+										const std::vector<KmerT> & initial_kmers,
+										const KmerPostings & postings,
+										boophf<KmerT> * bphf,
 										const ExpId2Name & exp_id2name,
 										const ExpId2Desc & exp_id2desc,
-										const ExpId2ReadCount & exp_id2readcount);
+										const ExpId2ReadCount & exp_id2readcount,
+										unsigned k,
+										uint32_t flags);
+
+// reads the metadata section of the database and checks that nothing follows it
+void read_metadata(std::istream & is,
+										ExpId2Name & exp_id2name,
+										ExpId2Desc & exp_id2desc,
+										ExpName2Id & exp_name2id,
+										ExpId2ReadCount & exp_id2readcount);
+
+// reads the header of a database file in any version, flags and k are only read from version 4 on
+HeaderDbFile read_database_header(std::istream & is);
+
+// the format flags of the database file, which are passed to write_database() to keep its format
+uint32_t database_flags(const std::string & filename);
+
+template<typename KmerT>
+void write_initial_database(const std::string & filename, const std::vector<KmerT> & initial_kmers, unsigned k, uint32_t flags);
+
+std::string segment_log_filename(const std::string & filename_db);
+
+// the size of the segments at the beginning of the segment log that are contained in the database file
+uint64_t merged_segments_size(const std::string & filename_db);
+// whether the segment log has segments that are not contained in the database file
+bool has_segments(const std::string & filename_db);
+
+// removes an incomplete segment at the end of the segment log and the segments
+// that are contained in the database file, before new segments are appended
+void repair_segment_log(const std::string & filename_db);
 
-void write_initial_database(const std::string & filename, const std::vector<Kmer> & initial_kmers);
+void append_segment(const std::string & filename_db,
+										ExperimentId exp_id,
+										const std::string & exp_name,
+										const std::string & exp_desc,
+										ReadCount read_count,
+										const SegmentEntries & entries);
 
 ExperimentId get_next_experiment_id(const ExpId2Name & exp_id2name);
 